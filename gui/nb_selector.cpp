@@ -190,7 +190,10 @@ void NBSelector::on_pushButton_clicked()
     for (int j = 0; j < 3; j++)
       processor->empty_neighbour(i, j);
   }
-  processor->calculate();
+  processor->schedule(ProcessedImage::Normal);
+  processor->schedule(ProcessedImage::Parallax);
+  processor->schedule(ProcessedImage::Specular);
+  processor->schedule(ProcessedImage::Occlusion);
   get_neighbours();
 }
 
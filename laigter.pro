@@ -42,10 +42,7 @@ CONFIG += core ui c++11
 QMAKE_CXXFLAGS_RELEASE *= -O3
 
 !macx {
-QMAKE_CXXFLAGS += -fopenmp
-QMAKE_LFLAGS += -fopenmp
-
-LIBS += -lgomp -lpthread
+LIBS += -lpthread
 }
 
 SOURCES += \
@@ -63,14 +60,30 @@ SOURCES += \
 	gui/widgets/themeselector.cpp \
 	main.cpp \
 	main_window.cpp \
+	src/cancellation.cpp \
+	src/compact_image.cpp \
+	src/distance_transform.cpp \
+	src/frame_layout.cpp \
+	src/gaussian_blur.cpp \
 	src/image_loader.cpp \
 	src/image_processor.cpp \
 	src/light_source.cpp \
+	src/memory_accountant.cpp \
+	src/morphology.cpp \
+	src/neighbour_canvas.cpp \
+	src/normal_kernels.cpp \
+	src/occupancy.cpp \
 	src/open_gl_widget.cpp \
+	src/planar_image.cpp \
 	gui/nb_selector.cpp \
 	src/project.cpp \
+	src/recompute_scheduler.cpp \
+	src/scratch_memory.cpp \
 	src/sprite.cpp \
+	src/stage_cache.cpp \
 	src/texture.cpp \
+	src/tiled_overlay.cpp \
+	src/worker_pool.cpp \
 	thirdparty/zip.c
 
 HEADERS += \
@@ -89,14 +102,31 @@ HEADERS += \
 	gui/widgets/themeselector.h \
 	main_window.h \
 	src/brush_interface.h \
+	src/cancellation.h \
+	src/compact_image.h \
+	src/distance_transform.h \
+	src/frame_layout.h \
+	src/gaussian_blur.h \
 	src/image_loader.h \
 	src/image_processor.h \
 	src/light_source.h \
+	src/memory_accountant.h \
+	src/morphology.h \
+	src/neighbour_canvas.h \
+	src/normal_kernels.h \
+	src/occupancy.h \
 	src/open_gl_widget.h \
+	src/planar_image.h \
 	gui/nb_selector.h \
 	src/project.h \
+	src/recompute_scheduler.h \
+	src/scratch_memory.h \
 	src/sprite.h \
+	src/stage_cache.h \
 	src/texture.h \
+	src/tiled_overlay.h \
+	src/tiling.h \
+	src/worker_pool.h \
 	thirdparty/CImg.h \
 	thirdparty/miniz.h \
 	thirdparty/zip.h
@@ -20,7 +20,11 @@
 
 #include "gui/presets_manager.h"
 #include "main_window.h"
+#include "src/compact_image.h"
 #include "src/image_processor.h"
+#include "src/memory_accountant.h"
+#include "src/scratch_memory.h"
+#include "src/worker_pool.h"
 
 #include <QApplication>
 #include <QCommandLineParser>
@@ -30,10 +34,9 @@
 #include <QOpenGLContext>
 #include <QSplashScreen>
 #include <QStandardPaths>
+#include <QTextStream>
 #include <QTranslator>
 
-#define cimg_use_openmp
-
 #define CHECK_CHANGES(outFileInfo, info) (outFileInfo.fileTime(QFile::FileModificationTime) < info.fileTime(QFile::FileModificationTime))
 
 
@@ -156,6 +159,25 @@ int main(int argc, char *argv[])
   QCommandLineOption checkChangesOption("check-changes", "only generate maps if the maps are older than the diffuse");
   argsParser.addOption(checkChangesOption);
 
+  QCommandLineOption memoryBudgetOption("memory-budget",
+                                        "keep processing buffers under this many MiB, spilling the rest to scratch files",
+                                        "MiB");
+  argsParser.addOption(memoryBudgetOption);
+
+  QCommandLineOption memoryReportOption("memory-report",
+                                        "print the memory held by every sprite and buffer when done");
+  argsParser.addOption(memoryReportOption);
+
+  QCommandLineOption precisionOption("precision",
+                                     "store intermediate maps as float, fixed16 or half",
+                                     "precision");
+  argsParser.addOption(precisionOption);
+
+  QCommandLineOption threadsOption("threads",
+                                   "number of processing threads, one per core by default",
+                                   "count");
+  argsParser.addOption(threadsOption);
+
   QSurfaceFormat fmt;
   fmt.setDepthBufferSize(24);
   fmt.setSamples(16);
@@ -164,6 +186,21 @@ int main(int argc, char *argv[])
   QScopedPointer<QCoreApplication> app(createApplication(argc, argv));
 
   argsParser.process(*app.data());
+
+  if (argsParser.isSet(memoryBudgetOption))
+  {
+    set_memory_budget(argsParser.value(memoryBudgetOption).toLongLong() * 1024 * 1024);
+  }
+  Precision precision;
+  if (argsParser.isSet(precisionOption) &&
+      parse_precision(argsParser.value(precisionOption), &precision))
+  {
+    set_intermediate_precision(precision);
+  }
+  if (argsParser.isSet(threadsOption))
+  {
+    WorkerPool::instance().set_thread_count(argsParser.value(threadsOption).toInt());
+  }
   QImage auximage;
 
   ImageProcessor *processor = new ImageProcessor();
@@ -174,6 +211,7 @@ int main(int argc, char *argv[])
 
   if (!inputDiffuseTextureOptionValue.trimmed().isEmpty())
   {
+    PriorityScope batch(Priority::Batch);
     QFileInfo info(inputDiffuseTextureOptionValue);
 
     QStringList fileList;
@@ -278,7 +316,6 @@ int main(int argc, char *argv[])
 
         if (!pressetOptionValue.trimmed().isEmpty())
         {
-          processor.recalculate_timer.stop();
           PresetsManager::applyPresets(pressetOptionValue, processor);
         }
 
@@ -288,6 +325,7 @@ int main(int argc, char *argv[])
         processor.has_specular = has_specular;
 
         processor.loadImage(imagePath, auximage);
+        processor.calculate();
 
         if (has_normal)
         {          
@@ -335,6 +373,12 @@ int main(int argc, char *argv[])
           QString name = outputDir.filePath(pathWithoutExtension + typeSuffix + suffix);
           parallax.save(name);
         }
+
+        if (argsParser.isSet(memoryReportOption))
+        {
+          processor.set_name(imagePath);
+          QTextStream(stdout) << MemoryAccountant::instance().summary();
+        }
     }
   }
 
@@ -366,6 +410,11 @@ int main(int argc, char *argv[])
     }
 
     returnCode = app->exec();
+
+    if (argsParser.isSet(memoryReportOption))
+    {
+      QTextStream(stdout) << MemoryAccountant::instance().summary();
+    }
   }
   else
   {
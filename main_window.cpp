@@ -364,8 +364,9 @@ void MainWindow::list_menu_action_triggered(QAction *action)
       painter.drawImage(position, h2);
 
       p->get_current_frame()->set_image(TextureTypes::Heightmap, h);
-      p->set_current_heightmap(p->get_current_frame_id());
-      p->calculate();
+      p->schedule(ProcessedImage::Normal);
+      p->schedule(ProcessedImage::Parallax);
+      p->schedule(ProcessedImage::Occlusion);
     }
   }
   else if (option == tr("Load specular map"))
@@ -1159,6 +1160,7 @@ void MainWindow::on_comboBox_currentIndexChanged(int index)
     }
 
     case ParallaxType::Quantization:
+    case ParallaxType::Intervals:
     {
       ui->parallaxMinHeight->setVisible(true);
       ui->parallaxSoftSlider->setVisible(true);
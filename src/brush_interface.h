@@ -14,6 +14,17 @@ class QRect;
 class ImageProcessor;
 QT_END_NAMESPACE
 
+/* Brushes paint into the overlays of the processor given to setProcessor
+ * and hand them back with set_*_overlay(image, rect), rect being the area
+ * painted. That schedules the maps the overlay feeds (see
+ * RecomputeScheduler), so there is nothing else to request.
+ *
+ * Since 2.0 the processor has no recalculate_timer, *_counter,
+ * rect_requested or *_requested members. recalculate() and
+ * generate_normal_map(bool, bool, bool, QRect) are kept, deprecated, and
+ * only schedule the maps. ImageProcessor changed layout too, so plugins
+ * built against 1.0 must be rebuilt: the new interface id keeps them from
+ * loading. */
 class BrushInterface
 {
 public:
@@ -34,7 +45,7 @@ signals:
   void selected_changed(BrushInterface *brush);
 };
 
-#define BrushInterface_iid "org.azagaya.laigter.plugins.BrushInterface/1.0"
+#define BrushInterface_iid "org.azagaya.laigter.plugins.BrushInterface/2.0"
 
 Q_DECLARE_INTERFACE(BrushInterface, BrushInterface_iid)
 
@@ -0,0 +1,33 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "cancellation.h"
+
+static thread_local const std::atomic<bool> *current_flag = nullptr;
+
+CancelScope::CancelScope(const std::atomic<bool> *flag) : previous(current_flag)
+{
+  current_flag = flag;
+}
+
+CancelScope::~CancelScope() { current_flag = previous; }
+
+const std::atomic<bool> *cancel_flag() { return current_flag; }
+
+bool cancelled() { return current_flag && current_flag->load(std::memory_order_relaxed); }
@@ -0,0 +1,47 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef CANCELLATION_H
+#define CANCELLATION_H
+
+#include <atomic>
+
+/* Cooperative cancellation of map recomputations, see RecomputeScheduler.
+ * A job runs inside a CancelScope holding its flag, and the tile and frame
+ * loops check cancelled() between iterations, skipping the rest of their
+ * work once the flag is raised. The results of a cancelled job are
+ * incomplete: nothing it produced may be cached or published.
+ *
+ * Scopes are per thread; the pool helpers of parallel_team run in the scope
+ * of the thread that started them. */
+class CancelScope
+{
+public:
+  explicit CancelScope(const std::atomic<bool> *flag);
+  ~CancelScope();
+
+private:
+  const std::atomic<bool> *previous;
+};
+
+/* Flag of the innermost scope of this thread, or nullptr */
+const std::atomic<bool> *cancel_flag();
+bool cancelled();
+
+#endif // CANCELLATION_H
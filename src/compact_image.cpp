@@ -0,0 +1,370 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "compact_image.h"
+#include "scratch_memory.h"
+
+#include <QByteArray>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LAIGTER_X86_DISPATCH
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+using namespace cimg_library;
+
+static Precision initial_precision()
+{
+  Precision precision = Precision::Float;
+  parse_precision(QString::fromLocal8Bit(qgetenv("LAIGTER_PRECISION")), &precision);
+  return precision;
+}
+
+static std::atomic<Precision> current_precision(initial_precision());
+
+void set_intermediate_precision(Precision precision) { current_precision = precision; }
+
+Precision intermediate_precision() { return current_precision; }
+
+bool parse_precision(const QString &name, Precision *precision)
+{
+  if (name == "float")
+    *precision = Precision::Float;
+  else if (name == "fixed16")
+    *precision = Precision::Fixed16;
+  else if (name == "half")
+    *precision = Precision::Half;
+  else
+    return false;
+  return true;
+}
+
+/* Half float conversions, rounding to nearest even, after F. Giesen's.
+ * Values past the half range, Inf included, saturate to its largest value so
+ * big distances don't turn into Inf; NaN becomes +65504. The F16C path gets
+ * the same results by clamping before the conversion. */
+
+const float half_max = 65504.0f;
+
+static quint16 float_to_half(float value)
+{
+  quint32 f;
+  memcpy(&f, &value, 4);
+  const quint32 sign = f & 0x80000000u;
+  f ^= sign;
+
+  quint32 h;
+  if (f >= (127u + 16) << 23)
+  {
+    /* Too big for a half, or Inf and NaN */
+    if (f > 255u << 23)
+      return 0x7bff;
+    h = 0x7bff;
+  }
+  else if (f < 113u << 23)
+  {
+    /* Subnormal half: adding 0.5 aligns the mantissa bits at the bottom */
+    float v;
+    memcpy(&v, &f, 4);
+    v += 0.5f;
+    memcpy(&f, &v, 4);
+    h = f - (126u << 23);
+  }
+  else
+  {
+    const quint32 odd = (f >> 13) & 1;
+    f += (static_cast<quint32>(15 - 127) << 23) + 0xfff + odd;
+    h = std::min(f >> 13, 0x7bffu);
+  }
+  return static_cast<quint16>(h | sign >> 16);
+}
+
+static float half_to_float(quint16 h)
+{
+  const quint32 shifted_exp = 0x7c00u << 13;
+  quint32 f = (h & 0x7fffu) << 13;
+  const quint32 exp = f & shifted_exp;
+  f += (127u - 15) << 23;
+
+  float v;
+  if (exp == shifted_exp)
+  {
+    f += (128u - 16) << 23;
+    memcpy(&v, &f, 4);
+  }
+  else if (exp == 0)
+  {
+    f += 1u << 23;
+    memcpy(&v, &f, 4);
+    const float magic = 6.103515625e-05f; /* 2^-14 */
+    v -= magic;
+  }
+  else
+  {
+    memcpy(&v, &f, 4);
+  }
+  return (h & 0x8000) ? -v : v;
+}
+
+static void to_half_scalar(const float *src, int count, quint16 *dst)
+{
+  for (int i = 0; i < count; i++)
+    dst[i] = float_to_half(src[i]);
+}
+
+static void from_half_scalar(const quint16 *src, int count, float *dst)
+{
+  for (int i = 0; i < count; i++)
+    dst[i] = half_to_float(src[i]);
+}
+
+#ifdef LAIGTER_X86_DISPATCH
+
+TARGET("avx,f16c")
+static void to_half_f16c(const float *src, int count, quint16 *dst)
+{
+  const __m256 hi = _mm256_set1_ps(half_max), lo = _mm256_set1_ps(-half_max);
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256 v = _mm256_max_ps(_mm256_min_ps(_mm256_loadu_ps(src + i), hi), lo);
+    __m128i h = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), h);
+  }
+  to_half_scalar(src + i, count - i, dst + i);
+}
+
+TARGET("avx,f16c")
+static void from_half_f16c(const quint16 *src, int count, float *dst)
+{
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+  from_half_scalar(src + i, count - i, dst + i);
+}
+
+#endif // LAIGTER_X86_DISPATCH
+
+struct HalfKernels
+{
+  void (*to_half)(const float *src, int count, quint16 *dst);
+  void (*from_half)(const quint16 *src, int count, float *dst);
+};
+
+static HalfKernels select_half_kernels()
+{
+  HalfKernels k = {to_half_scalar, from_half_scalar};
+#ifdef LAIGTER_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+  {
+    k = {to_half_f16c, from_half_f16c};
+  }
+#endif
+  return k;
+}
+
+static const HalfKernels &half_kernels()
+{
+  static const HalfKernels kernels = select_half_kernels();
+  return kernels;
+}
+
+CompactImage::CompactImage(int width, int height, int channels, float lo, float hi)
+    : m_width(width), m_height(height), m_channels(channels),
+      m_precision(intermediate_precision())
+{
+  if (m_precision == Precision::Fixed16 && !(hi < unbounded))
+  {
+    m_precision = Precision::Half;
+  }
+  if (m_precision == Precision::Fixed16)
+  {
+    m_lo = lo;
+    m_scale = 65535.0f / (hi > lo ? hi - lo : 1.0f);
+  }
+
+  const qint64 count = qint64(width) * height * channels;
+  if (count <= 0)
+    return;
+
+  m_storage = scratch_buffer(count * (m_precision == Precision::Float ? 4 : 2));
+  if (m_precision == Precision::Float)
+    m_floats = static_cast<float *>(m_storage.get());
+  else
+    m_codes = static_cast<quint16 *>(m_storage.get());
+}
+
+std::shared_ptr<CompactImage> CompactImage::from(CImg<float> &&image, float lo, float hi)
+{
+  if (intermediate_precision() == Precision::Float && !tiled_processing())
+  {
+    std::shared_ptr<CompactImage> out(new CompactImage());
+    auto pixels = std::make_shared<CImg<float>>(std::move(image));
+    out->m_width = pixels->width();
+    out->m_height = pixels->height() * pixels->depth();
+    out->m_channels = pixels->spectrum();
+    out->m_floats = pixels->data();
+    out->m_storage = pixels;
+    return out;
+  }
+
+  auto out = std::make_shared<CompactImage>(image.width(), image.height() * image.depth(),
+                                            image.spectrum(), lo, hi);
+  out->draw_image(0, 0, image);
+  image.assign();
+  return out;
+}
+
+bool CompactImage::is_empty() const { return !m_storage; }
+
+int CompactImage::width() const { return m_width; }
+
+int CompactImage::height() const { return m_height; }
+
+int CompactImage::spectrum() const { return m_channels; }
+
+Precision CompactImage::precision() const { return m_precision; }
+
+qint64 CompactImage::bytes() const
+{
+  return qint64(m_width) * m_height * m_channels * (m_precision == Precision::Float ? 4 : 2);
+}
+
+size_t CompactImage::offset(int x, int y, int c) const
+{
+  return (static_cast<size_t>(c) * m_height + y) * m_width + x;
+}
+
+void CompactImage::read(int x, int y, int c, int count, float *dst) const
+{
+  const size_t at = offset(x, y, c);
+  switch (m_precision)
+  {
+    case Precision::Float:
+      memcpy(dst, m_floats + at, count * sizeof(float));
+      break;
+    case Precision::Half:
+      half_kernels().from_half(m_codes + at, count, dst);
+      break;
+    case Precision::Fixed16:
+    {
+      const quint16 *src = m_codes + at;
+      const float lo = m_lo, step = 1.0f / m_scale;
+      for (int i = 0; i < count; i++)
+        dst[i] = lo + src[i] * step;
+      break;
+    }
+  }
+}
+
+void CompactImage::write(int x, int y, int c, int count, const float *src)
+{
+  const size_t at = offset(x, y, c);
+  switch (m_precision)
+  {
+    case Precision::Float:
+      memcpy(m_floats + at, src, count * sizeof(float));
+      break;
+    case Precision::Half:
+      half_kernels().to_half(src, count, m_codes + at);
+      break;
+    case Precision::Fixed16:
+    {
+      quint16 *dst = m_codes + at;
+      const float lo = m_lo, scale = m_scale;
+      for (int i = 0; i < count; i++)
+      {
+        float v = (src[i] - lo) * scale + 0.5f;
+        dst[i] = v <= 0.0f ? 0 : v >= 65535.0f ? 65535 : static_cast<quint16>(v);
+      }
+      break;
+    }
+  }
+}
+
+const float *CompactImage::span(int x, int y, int c, int count, float *buffer) const
+{
+  if (m_floats)
+    return m_floats + offset(x, y, c);
+  read(x, y, c, count, buffer);
+  return buffer;
+}
+
+void CompactImage::fill(float value)
+{
+  std::vector<float> row(m_width, value);
+  for (int c = 0; c < m_channels; c++)
+  {
+    for (int y = 0; y < m_height; y++)
+      write(0, y, c, m_width, row.data());
+  }
+}
+
+CImg<float> CompactImage::get_crop(int x0, int y0, int x1, int y1) const
+{
+  CImg<float> out(x1 - x0 + 1, y1 - y0 + 1, 1, m_channels, 0.0f);
+  const QRect r = QRect(x0, y0, out.width(), out.height()).intersected(QRect(0, 0, m_width, m_height));
+  for (int c = 0; c < m_channels && !r.isEmpty(); c++)
+  {
+    for (int y = r.top(); y <= r.bottom(); y++)
+      read(r.left(), y, c, r.width(), out.data(r.left() - x0, y - y0, 0, c));
+  }
+  return out;
+}
+
+void CompactImage::draw_image(int x, int y, const CImg<float> &img)
+{
+  const QRect r = QRect(x, y, img.width(), img.height()).intersected(QRect(0, 0, m_width, m_height));
+  const int channels = std::min(m_channels, img.spectrum());
+  for (int c = 0; c < channels && !r.isEmpty(); c++)
+  {
+    for (int row = r.top(); row <= r.bottom(); row++)
+      write(r.left(), row, c, r.width(), img.data(r.left() - x, row - y, 0, c));
+  }
+}
+
+void CompactImage::copy_region(const CompactImage &src, const QRect &r)
+{
+  const bool same = src.m_precision == m_precision &&
+                    (m_precision != Precision::Fixed16 || (src.m_lo == m_lo && src.m_scale == m_scale));
+  std::vector<float> buffer(same ? 0 : r.width());
+  for (int c = 0; c < m_channels; c++)
+  {
+    for (int y = r.top(); y <= r.bottom(); y++)
+    {
+      const size_t at = offset(r.left(), y, c);
+      if (!same)
+        write(r.left(), y, c, r.width(), src.span(r.left(), y, c, r.width(), buffer.data()));
+      else if (m_floats)
+        memcpy(m_floats + at, src.m_floats + at, r.width() * sizeof(float));
+      else
+        memcpy(m_codes + at, src.m_codes + at, r.width() * sizeof(quint16));
+    }
+  }
+}
@@ -0,0 +1,100 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef COMPACTIMAGE_H
+#define COMPACTIMAGE_H
+
+#include <QRect>
+#include <QString>
+#include <QtGlobal>
+
+#include <limits>
+#include <memory>
+
+#define cimg_display 0
+#include "thirdparty/CImg.h"
+
+/* How stage intermediates are stored. Fixed16 keeps 16 bit codes over the
+ * value range the stage declares, Half keeps IEEE half floats; both halve
+ * the memory and bandwidth of Float. Values are widened back to float a
+ * span at a time, in buffers that stay in L1, so the kernels don't change.
+ * The LAIGTER_PRECISION environment variable (float, fixed16, half) sets
+ * the starting mode, the CLI can set it with --precision. */
+enum class Precision
+{
+  Float,
+  Fixed16,
+  Half
+};
+
+void set_intermediate_precision(Precision precision);
+Precision intermediate_precision();
+bool parse_precision(const QString &name, Precision *precision);
+
+/* Upper bound for values without one. Fixed16 needs a bound, so those are
+ * stored as half floats in that mode. */
+const float unbounded = std::numeric_limits<float>::infinity();
+
+/* Float image stored at the intermediate precision of the moment it is
+ * created. Storage comes from scratch_memory, so it honours the memory
+ * budget. Disjoint spans may be written from different threads. */
+class CompactImage
+{
+public:
+  /* Values are expected in [lo, hi]; Fixed16 clamps to it */
+  CompactImage(int width, int height, int channels, float lo = 0.0f, float hi = 255.0f);
+  /* Takes the pixels of image, without copying them when stored as floats */
+  static std::shared_ptr<CompactImage> from(cimg_library::CImg<float> &&image, float lo = 0.0f,
+                                            float hi = 255.0f);
+
+  bool is_empty() const;
+  int width() const;
+  int height() const;
+  int spectrum() const;
+  Precision precision() const;
+  qint64 bytes() const;
+
+  /* count values of row y of channel c, starting at x */
+  void read(int x, int y, int c, int count, float *dst) const;
+  void write(int x, int y, int c, int count, const float *src);
+  /* The floats of a span: the stored ones, or the span widened into
+   * buffer, which must hold count floats */
+  const float *span(int x, int y, int c, int count, float *buffer) const;
+
+  void fill(float value);
+  /* Float copy of [x0, x1] x [y0, y1], 0 outside of the image */
+  cimg_library::CImg<float> get_crop(int x0, int y0, int x1, int y1) const;
+  /* Writes every channel of img with its top left corner at (x, y) */
+  void draw_image(int x, int y, const cimg_library::CImg<float> &img);
+  /* Copies r from src, which has the same size */
+  void copy_region(const CompactImage &src, const QRect &r);
+
+private:
+  CompactImage() {}
+  size_t offset(int x, int y, int c) const;
+
+  int m_width = 0, m_height = 0, m_channels = 0;
+  Precision m_precision = Precision::Float;
+  float m_lo = 0.0f, m_scale = 1.0f;
+  std::shared_ptr<void> m_storage;
+  float *m_floats = nullptr;
+  quint16 *m_codes = nullptr;
+};
+
+#endif // COMPACTIMAGE_H
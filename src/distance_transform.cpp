@@ -0,0 +1,161 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "distance_transform.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace cimg_library;
+
+/* Squared distance standing for "no zero pixel" */
+static const double far_away = 1e20;
+
+/* Vertical pass: distance to the nearest zero of the same column. Columns
+ * are swept together a block at a time, so the inner loops run along rows. */
+static void column_pass(const float *src, int width, int height, bool wrap, int *g)
+{
+  const int none = width + 2 * height + 1;
+  const int block = 256;
+  const int blocks = (width + block - 1) / block;
+
+  parallel_for(blocks, static_cast<long>(width) * height > 65536, [&](int b) {
+    const int x0 = b * block;
+    const int x1 = std::min(x0 + block, width);
+
+    for (int x = x0; x < x1; x++)
+    {
+      g[x] = src[x] == 0 ? 0 : none;
+    }
+    /* Periodic columns need a second lap for zeros near the other end */
+    const int laps = wrap ? 2 : 1;
+    for (int lap = 0; lap < laps; lap++)
+    {
+      for (int y = lap ? 0 : 1; y < height; y++)
+      {
+        const float *s = src + static_cast<size_t>(y) * width;
+        int *row = g + static_cast<size_t>(y) * width;
+        const int *prev = g + static_cast<size_t>(y > 0 ? y - 1 : height - 1) * width;
+        for (int x = x0; x < x1; x++)
+        {
+          int d = std::min(prev[x] + 1, none);
+          row[x] = s[x] == 0 ? 0 : lap ? std::min(row[x], d) : d;
+        }
+      }
+    }
+    for (int lap = 0; lap < laps; lap++)
+    {
+      for (int y = lap ? height - 1 : height - 2; y >= 0; y--)
+      {
+        int *row = g + static_cast<size_t>(y) * width;
+        const int *next = g + static_cast<size_t>(y < height - 1 ? y + 1 : 0) * width;
+        for (int x = x0; x < x1; x++)
+        {
+          row[x] = std::min(row[x], next[x] + 1);
+        }
+      }
+    }
+  });
+}
+
+/* 1D squared distance transform of f (Felzenszwalb and Huttenlocher).
+ * Doubles keep the squared coordinates exact on big canvases. */
+static void envelope(const double *f, int n, double *d, int *v, double *z)
+{
+  int k = 0;
+  v[0] = 0;
+  z[0] = -far_away;
+  z[1] = far_away;
+  for (int q = 1; q < n; q++)
+  {
+    double s;
+    while (true)
+    {
+      const int p = v[k];
+      s = ((f[q] + static_cast<double>(q) * q) - (f[p] + static_cast<double>(p) * p)) / (2.0 * (q - p));
+      if (s > z[k])
+        break;
+      k--;
+    }
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = far_away;
+  }
+
+  k = 0;
+  for (int q = 0; q < n; q++)
+  {
+    while (z[k + 1] < q)
+      k++;
+    const double dq = q - v[k];
+    d[q] = dq * dq + f[v[k]];
+  }
+}
+
+/* Horizontal pass over each row, then the square root */
+static void row_pass(const int *g, int width, int height, bool wrap, float *out)
+{
+  const int none = width + 2 * height + 1;
+  /* Periodic rows are unrolled three times and the middle copy is kept */
+  const int n = wrap ? 3 * width : width;
+  const int offset = wrap ? width : 0;
+
+  std::atomic<int> next(0);
+  parallel_team(height, static_cast<long>(width) * height > 65536, [&]() {
+    std::vector<double> f(n), d(n), z(n + 1);
+    std::vector<int> v(n);
+
+    for (int y = next++; y < height; y = next++)
+    {
+      const int *row = g + static_cast<size_t>(y) * width;
+      for (int i = 0; i < n; i++)
+      {
+        int gx = row[i % width];
+        f[i] = gx >= none ? far_away : static_cast<double>(gx) * gx;
+      }
+      envelope(f.data(), n, d.data(), v.data(), z.data());
+
+      float *o = out + static_cast<size_t>(y) * width;
+      for (int x = 0; x < width; x++)
+      {
+        o[x] = static_cast<float>(std::sqrt(d[offset + x]));
+      }
+    }
+  });
+}
+
+void distance_transform(CImg<float> &img, bool wrap_x, bool wrap_y)
+{
+  if (img.is_empty())
+    return;
+
+  const int width = img.width();
+  const int height = img.height() * img.depth();
+  std::vector<int> g(static_cast<size_t>(width) * height);
+
+  for (int c = 0; c < img.spectrum(); c++)
+  {
+    float *plane = img.data(0, 0, 0, c);
+    column_pass(plane, width, height, wrap_y, g.data());
+    row_pass(g.data(), width, height, wrap_x, plane);
+  }
+}
@@ -0,0 +1,36 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef DISTANCETRANSFORM_H
+#define DISTANCETRANSFORM_H
+
+#define cimg_display 0
+#include "thirdparty/CImg.h"
+
+/* Exact Euclidean distance from every pixel to the nearest pixel equal to 0,
+ * in place and per channel. Same result as CImg::distance(0), but in linear
+ * time and on every core: a vertical pass finds the nearest zero in each
+ * column, then a horizontal lower envelope of parabolas (Felzenszwalb and
+ * Huttenlocher) combines the columns.
+ *
+ * wrap_x and wrap_y make the image periodic along that axis, for sprites
+ * that tile. Pixels with no zero at all get a huge distance. */
+void distance_transform(cimg_library::CImg<float> &img, bool wrap_x = false, bool wrap_y = false);
+
+#endif // DISTANCETRANSFORM_H
@@ -0,0 +1,164 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "frame_layout.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+FrameLayout::FrameLayout() {}
+
+FrameLayout::FrameLayout(QSize sprite, int h_frames, int v_frames, bool canvas, int halo)
+    : m_sprite(sprite), m_h(std::max(h_frames, 1)), m_v(std::max(v_frames, 1)), m_canvas(canvas),
+      m_halo(halo)
+{
+  m_width = sprite.width() / m_h;
+  m_height = sprite.height() / m_v;
+}
+
+int FrameLayout::count() const { return m_h * m_v; }
+
+bool FrameLayout::canvas() const { return m_canvas; }
+
+int FrameLayout::halo() const { return m_halo; }
+
+QSize FrameLayout::sprite_size() const { return m_sprite; }
+
+/* The cell before a frame is as long as a regular frame. The cell after the
+ * last frame takes what is left of three times its length, as the old 9x
+ * canvas image had it. */
+int FrameLayout::before(int regular) const
+{
+  return m_halo < 0 ? regular : std::min(m_halo, regular);
+}
+
+int FrameLayout::after(int k, int count, int regular, int length) const
+{
+  int cell = k == count - 1 ? 2 * length - regular : regular;
+  return m_halo < 0 ? cell : std::min(m_halo, cell);
+}
+
+QSize FrameLayout::source_size() const
+{
+  if (!m_canvas)
+    return m_sprite;
+
+  QRect last = frame(count() - 1);
+  return QSize(last.left() + 2 * (m_h - 1) * before(m_width) + before(m_width) + last.width() +
+                   after(m_h - 1, m_h, m_width, last.width()),
+               last.top() + 2 * (m_v - 1) * before(m_height) + before(m_height) + last.height() +
+                   after(m_v - 1, m_v, m_height, last.height()));
+}
+
+QRect FrameLayout::frame(int i) const
+{
+  int x = i % m_h, y = i / m_h;
+  int w = x == m_h - 1 ? m_sprite.width() - x * m_width : m_width;
+  int h = y == m_v - 1 ? m_sprite.height() - y * m_height : m_height;
+  return QRect(x * m_width, y * m_height, w, h);
+}
+
+QRect FrameLayout::source(int i) const
+{
+  if (!m_canvas)
+    return frame(i);
+
+  QRect f = frame(i);
+  QPoint d = source_offset(i);
+  int left = f.left() + d.x() - before(m_width), top = f.top() + d.y() - before(m_height);
+  int right = f.left() + d.x() + f.width() + after(i % m_h, m_h, m_width, f.width());
+  int bottom = f.top() + d.y() + f.height() + after(i / m_h, m_v, m_height, f.height());
+  return QRect(left, top, right - left, bottom - top);
+}
+
+QPoint FrameLayout::source_offset(int i) const
+{
+  if (!m_canvas)
+    return QPoint(0, 0);
+
+  int x = i % m_h, y = i / m_h;
+  return QPoint((2 * x + 1) * before(m_width), (2 * y + 1) * before(m_height));
+}
+
+QPoint FrameLayout::offset_to(const FrameLayout &other, int i) const
+{
+  return other.source_offset(i) - source_offset(i);
+}
+
+QVector<int> FrameLayout::frames_in(const QRect &r) const
+{
+  QVector<int> frames;
+  for (int i = 0; i < count(); i++)
+  {
+    if (frame(i).intersects(r))
+      frames.append(i);
+  }
+  return frames;
+}
+
+static quint64 mix(quint64 x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* Eight bytes per step; the tail is zero padded, the row length goes in
+ * through the caller's region size. */
+quint64 hash_bytes(const uchar *data, int count, quint64 h)
+{
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    quint64 word;
+    memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  if (i < count)
+  {
+    quint64 word = 0;
+    memcpy(&word, data + i, count - i);
+    h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+QVector<quint64> region_hashes(const PlanarImage &planes, const QVector<QRect> &regions)
+{
+  QVector<quint64> hashes(regions.size());
+  const QRect bounds(0, 0, planes.width(), planes.height());
+
+  parallel_for(regions.size(), regions.size() > 1, [&](int i) {
+    QRect r = regions[i].intersected(bounds);
+    quint64 h = mix(static_cast<quint64>(r.width()) << 32 | static_cast<quint32>(r.height()));
+    for (int c = 0; c < planes.channels() && !r.isEmpty(); c++)
+    {
+      const uchar *plane = planes.plane(c);
+      for (int y = r.top(); y <= r.bottom(); y++)
+      {
+        h = hash_bytes(plane + static_cast<size_t>(y) * planes.width() + r.left(), r.width(), h);
+      }
+    }
+    hashes[i] = mix(h);
+  });
+  return hashes;
+}
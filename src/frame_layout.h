@@ -0,0 +1,86 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef FRAMELAYOUT_H
+#define FRAMELAYOUT_H
+
+#include "src/planar_image.h"
+
+#include <QPoint>
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+/* Frames of a sprite sheet, as splitInFrames cuts it. Stages work frame by
+ * frame: each frame is computed from its own part of the stage source only,
+ * so frames are independent units that run in parallel, and a frame whose
+ * inputs didn't change keeps its previous result.
+ *
+ * Frames are numbered like getFrameRect does, h_frames * y + x. The frames
+ * of the last column and row also take the pixels left over when the sprite
+ * size is not a multiple of the frame count. */
+class FrameLayout
+{
+public:
+  FrameLayout();
+  /* canvas: the stage source is the neighbours canvas of a tileable
+   * sprite. Each frame keeps halo pixels of its neighbours around it, or
+   * with a negative halo the whole neighbour cells, which makes the source
+   * three times the sprite size. */
+  FrameLayout(QSize sprite, int h_frames, int v_frames, bool canvas, int halo = -1);
+
+  int count() const;
+  bool canvas() const;
+  int halo() const;
+  QSize sprite_size() const;
+  QSize source_size() const;
+
+  /* Part of the sprite covered by frame i */
+  QRect frame(int i) const;
+  /* Part of the source frame i is computed from: the frame itself, or its
+   * 3x3 block of the canvas, which shows the frame and the neighbours
+   * chosen for it (see NeighbourCanvas), cut down to the halo */
+  QRect source(int i) const;
+  /* Where frame i lies inside source(i), relative to frame(i) */
+  QPoint source_offset(int i) const;
+  /* Moves source coordinates of frame i to those of other */
+  QPoint offset_to(const FrameLayout &other, int i) const;
+  /* Frames touching r, in sprite coordinates */
+  QVector<int> frames_in(const QRect &r) const;
+
+private:
+  /* Halo kept before and after the frame at index k of count, with frames
+   * of regular length and the last one of length */
+  int before(int regular) const;
+  int after(int k, int count, int regular, int length) const;
+
+  QSize m_sprite;
+  int m_h = 1, m_v = 1;
+  int m_width = 0, m_height = 0;
+  bool m_canvas = false;
+  int m_halo = -1;
+};
+
+/* Content hash of every region of planes, all channels included. Regions
+ * are clipped to the planes. */
+QVector<quint64> region_hashes(const PlanarImage &planes, const QVector<QRect> &regions);
+/* Hash of count bytes of data, continuing h */
+quint64 hash_bytes(const uchar *data, int count, quint64 h);
+
+#endif // FRAMELAYOUT_H
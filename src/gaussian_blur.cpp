@@ -0,0 +1,198 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "gaussian_blur.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace cimg_library;
+
+/* Lines filtered together, one SIMD friendly row of the strip each */
+static const int strip_lanes = 64;
+
+struct Coefficients
+{
+  /* Recursive filter: w[i] = b * x[i] + a1 * w[i - 1] + a2 * w[i - 2] + a3 * w[i - 3] */
+  float b, a1, a2, a3;
+  /* Three tap kernel for small sigmas */
+  bool fir;
+  float g0, g1;
+  /* Samples read past each border */
+  int pad;
+};
+
+static Coefficients coefficients(float sigma)
+{
+  Coefficients c = {};
+  if (sigma < 0.5f)
+  {
+    float e = std::exp(-0.5f / (sigma * sigma));
+    c.fir = true;
+    c.g0 = 1.0f / (1.0f + 2.0f * e);
+    c.g1 = e * c.g0;
+    c.pad = 1;
+    return c;
+  }
+
+  double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                          : 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * sigma);
+  double q2 = q * q, q3 = q2 * q;
+  double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+  c.a1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+  c.a2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+  c.a3 = 0.422205 * q3 / b0;
+  c.b = 1.0f - (c.a1 + c.a2 + c.a3);
+  /* The impulse response is below 1e-4 of its peak past 4 sigma */
+  c.pad = static_cast<int>(std::ceil(4.0f * sigma)) + 3;
+  return c;
+}
+
+/* Filters lanes lines of n samples in place, sample i of line l being
+ * buf[i * lanes + l]. Outside the buffer the edge samples repeat. */
+static void filter_lines(float *buf, int n, int lanes, const Coefficients &c)
+{
+  std::vector<float> edge(buf, buf + lanes);
+
+  if (c.fir)
+  {
+    std::vector<float> prev(edge);
+    for (int i = 0; i < n; i++)
+    {
+      float *row = buf + static_cast<size_t>(i) * lanes;
+      const float *next = i + 1 < n ? row + lanes : row;
+      for (int l = 0; l < lanes; l++)
+      {
+        float x = row[l];
+        row[l] = c.g0 * x + c.g1 * (prev[l] + next[l]);
+        prev[l] = x;
+      }
+    }
+    return;
+  }
+
+  /* Forward, starting from the steady state of the first sample */
+  for (int i = 0; i < n; i++)
+  {
+    float *row = buf + static_cast<size_t>(i) * lanes;
+    const float *p1 = i >= 1 ? row - lanes : edge.data();
+    const float *p2 = i >= 2 ? row - 2 * lanes : edge.data();
+    const float *p3 = i >= 3 ? row - 3 * lanes : edge.data();
+    for (int l = 0; l < lanes; l++)
+    {
+      row[l] = c.b * row[l] + c.a1 * p1[l] + c.a2 * p2[l] + c.a3 * p3[l];
+    }
+  }
+
+  /* Backward, from the steady state of the last forward output */
+  edge.assign(buf + static_cast<size_t>(n - 1) * lanes, buf + static_cast<size_t>(n) * lanes);
+  for (int i = n - 1; i >= 0; i--)
+  {
+    float *row = buf + static_cast<size_t>(i) * lanes;
+    const float *p1 = i + 1 < n ? row + lanes : edge.data();
+    const float *p2 = i + 2 < n ? row + 2 * lanes : edge.data();
+    const float *p3 = i + 3 < n ? row + 3 * lanes : edge.data();
+    for (int l = 0; l < lanes; l++)
+    {
+      row[l] = c.b * row[l] + c.a1 * p1[l] + c.a2 * p2[l] + c.a3 * p3[l];
+    }
+  }
+}
+
+/* Blurs the lines of a width x height plane along x (horizontal) or y.
+ * Lines get pad extra samples on each side, repeated edge pixels or wrapped
+ * ones, which is enough for the filters to forget how they started. */
+static void blur_axis(float *plane, int width, int height, bool horizontal, bool wrap,
+                      const Coefficients &c)
+{
+  const int length = horizontal ? width : height;
+  const int count = horizontal ? height : width;
+  const int pad = c.pad;
+  const int n = length + 2 * pad;
+  const int strips = (count + strip_lanes - 1) / strip_lanes;
+
+  std::atomic<int> next(0);
+  parallel_team(strips, static_cast<long>(width) * height > 65536, [&]() {
+    std::vector<float> buf(static_cast<size_t>(n) * strip_lanes);
+
+    for (int s = next++; s < strips; s = next++)
+    {
+      const int first = s * strip_lanes;
+      const int lanes = std::min(strip_lanes, count - first);
+
+      for (int i = 0; i < n; i++)
+      {
+        int k = wrap ? ((i - pad) % length + length) % length
+                     : std::min(std::max(i - pad, 0), length - 1);
+        float *dst = buf.data() + static_cast<size_t>(i) * lanes;
+        if (horizontal)
+        {
+          for (int l = 0; l < lanes; l++)
+            dst[l] = plane[static_cast<size_t>(first + l) * width + k];
+        }
+        else
+        {
+          std::copy_n(plane + static_cast<size_t>(k) * width + first, lanes, dst);
+        }
+      }
+
+      filter_lines(buf.data(), n, lanes, c);
+
+      for (int i = 0; i < length; i++)
+      {
+        const float *src = buf.data() + static_cast<size_t>(i + pad) * lanes;
+        if (horizontal)
+        {
+          for (int l = 0; l < lanes; l++)
+            plane[static_cast<size_t>(first + l) * width + i] = src[l];
+        }
+        else
+        {
+          std::copy_n(src, lanes, plane + static_cast<size_t>(i) * width + first);
+        }
+      }
+    }
+  });
+}
+
+int gaussian_reach(float sigma)
+{
+  return sigma > 0 ? coefficients(sigma).pad : 0;
+}
+
+void gaussian_blur(CImg<float> &img, float sigma, bool wrap_x, bool wrap_y)
+{
+  if (img.is_empty() || !(sigma > 0))
+    return;
+
+  const Coefficients c = coefficients(sigma);
+  for (int ch = 0; ch < img.spectrum(); ch++)
+  {
+    for (int z = 0; z < img.depth(); z++)
+    {
+      float *plane = img.data(0, 0, z, ch);
+      if (img.width() > 1)
+        blur_axis(plane, img.width(), img.height(), true, wrap_x, c);
+      if (img.height() > 1)
+        blur_axis(plane, img.width(), img.height(), false, wrap_y, c);
+    }
+  }
+}
@@ -0,0 +1,44 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef GAUSSIANBLUR_H
+#define GAUSSIANBLUR_H
+
+#define cimg_display 0
+#include "thirdparty/CImg.h"
+
+/* Gaussian blur of standard deviation sigma, in place and per channel.
+ *
+ * A third order recursive filter (Young and van Vliet) runs forwards and
+ * backwards along each axis, so the cost per pixel is the same for any
+ * sigma. Lines are filtered in strips of neighbouring lines, which keeps
+ * the inner loops contiguous on both axes, and the strips are spread over
+ * the threads. Below sigma 0.5, where the recursive approximation falls
+ * apart, a three tap kernel is used instead.
+ *
+ * Borders repeat the edge pixels, like CImg::blur, unless wrap_x or wrap_y
+ * make the image periodic along that axis. */
+void gaussian_blur(cimg_library::CImg<float> &img, float sigma, bool wrap_x = false,
+                   bool wrap_y = false);
+
+/* Pixels past which gaussian_blur no longer reads: a tile padded with this
+ * many pixels blurs its interior like the whole image would. */
+int gaussian_reach(float sigma);
+
+#endif // GAUSSIANBLUR_H
@@ -18,11 +18,21 @@
  */
 
 #include "image_processor.h"
+#include "distance_transform.h"
+#include "gaussian_blur.h"
+#include "morphology.h"
+#include "scratch_memory.h"
+#include "normal_kernels.h"
+#include "recompute_scheduler.h"
+#include "tiling.h"
+#include "worker_pool.h"
 
 #include <cmath>
+#include <cstring>
+#include <vector>
 
 #include <QApplication>
-#include <QtConcurrent/QtConcurrent>
+#include <QSet>
 
 using namespace cimg_library;
 
@@ -37,7 +47,9 @@ void SetAlphaChannel(const QImage &src, QImage &dst)
   }
 }
 
-ImageProcessor::ImageProcessor(QObject *parent) : QObject(parent)
+ImageProcessor::ImageProcessor(QObject *parent) : ImageProcessor(parent, true) {}
+
+ImageProcessor::ImageProcessor(QObject *parent, bool accounted) : QObject(parent)
 {
   position = offset = QVector3D(0, 0, 0);
   zoom = 1.0;
@@ -118,17 +130,15 @@ ImageProcessor::ImageProcessor(QObject *parent) : QObject(parent)
   connected = false;
   customSpecularMap = false;
   customHeightMap = false;
-  normal_counter = parallax_counter = specular_counter = occlussion_counter = 0;
+
+  previews[0].factor = 4;
+  previews[1].factor = 2;
 
   connect(&animation, SIGNAL(timeout()), this, SLOT(next_frame()));
-  connect(&recalculate_timer, SIGNAL(timeout()), this, SLOT(recalculate()));
 
   animation.setInterval(80);
   animation.setSingleShot(false);
 
-  recalculate_timer.setInterval(40);
-  recalculate_timer.setSingleShot(false);
-
   QVector<float> new_vertices;
   for (int i = 0; i < 20; i++)
     new_vertices.append(current_vertices[i]);
@@ -136,6 +146,189 @@ ImageProcessor::ImageProcessor(QObject *parent) : QObject(parent)
 
   animation_list.append(Animation("Default"));
   current_animation = getAnimation("Default");
+  if (accounted)
+    MemoryAccountant::instance().add(this);
+}
+
+ImageProcessor::~ImageProcessor()
+{
+  MemoryAccountant::instance().remove(this);
+  RecomputeScheduler::instance().forget(this);
+}
+
+/* Names of the textures in the memory reports, in TextureTypes order */
+static const char *texture_names[] = {
+    "diffuse",         "normal",           "specular",         "parallax",
+    "occlusion",       "heightmap",        "distance",         "neighbours",
+    "specular base",   "occlusion base",   "color",            "texture overlay",
+    "normal overlay",  "heightmap overlay", "specular overlay", "parallax overlay",
+    "occlusion overlay"};
+
+bool ImageProcessor::try_lock_maps()
+{
+  QMutex *maps[] = {&normal_mutex, &parallax_mutex, &specular_mutex, &occlusion_mutex};
+  for (int i = 0; i < 4; i++)
+  {
+    if (!maps[i]->tryLock())
+    {
+      while (i-- > 0)
+        maps[i]->unlock();
+      return false;
+    }
+  }
+  return true;
+}
+
+void ImageProcessor::unlock_maps()
+{
+  occlusion_mutex.unlock();
+  specular_mutex.unlock();
+  parallax_mutex.unlock();
+  normal_mutex.unlock();
+}
+
+/* Needs the maps locked. The published composed maps are not counted: they
+ * share their pixels with the map textures. */
+QList<BufferUsage> ImageProcessor::measure()
+{
+  QList<BufferUsage> usage;
+  auto add = [&](const QString &name, qint64 bytes, bool intermediate) {
+    BufferUsage buffer;
+    buffer.name = name;
+    buffer.bytes = bytes;
+    buffer.intermediate = intermediate;
+    usage.append(buffer);
+  };
+
+  /* Stage outputs are shared by the cache, the frame runs and the normal
+   * inputs, each one is counted once */
+  QSet<const CompactImage *> seen;
+  auto images = [&](const QString &name, const QList<StageImage> &list) {
+    qint64 bytes = 0;
+    for (const StageImage &image : list)
+    {
+      if (image && !seen.contains(image.get()))
+      {
+        seen.insert(image.get());
+        bytes += image->bytes();
+      }
+    }
+    add(name, bytes, true);
+  };
+  images("stage cache", stage_cache.images());
+  QList<StageImage> runs;
+  {
+    QMutexLocker locker(&frame_mutex);
+    for (const FrameRun &run : frame_runs)
+    {
+      runs.append(run.image);
+    }
+  }
+  images("frame runs", runs);
+  images("emboss normals", {m_emboss_normal});
+  images("bevel normals", {m_distance_normal});
+  images("height overlay normals", {m_height_ov, m_height_in});
+  add("map back buffers",
+      composed_normal.back_bytes() + composed_parallax.back_bytes() +
+          composed_specular.back_bytes() + composed_occlusion.back_bytes(),
+      true);
+  add("texture planes", sprite.planes_bytes(), true);
+
+  /* prepare_preview() may be scaling textures for a copy, previews being
+   * updated count as they were last seen instead of waiting for it */
+  qint64 preview = 0, preview_textures = 0;
+  if (preview_mutex.tryLock())
+  {
+    for (PreviewLevel &level : previews)
+    {
+      if (!level.processor)
+        continue;
+      for (const BufferUsage &buffer : level.processor->memory_usage())
+      {
+        (buffer.intermediate ? preview : preview_textures) += buffer.bytes;
+      }
+    }
+    preview_mutex.unlock();
+  }
+  else
+  {
+    for (const BufferUsage &buffer : last_usage)
+    {
+      if (buffer.name == "previews")
+        preview = buffer.bytes;
+      else if (buffer.name == "preview textures")
+        preview_textures = buffer.bytes;
+    }
+  }
+  add("previews", preview, true);
+  add("preview textures", preview_textures, false);
+
+  for (int t = 0; t < 17; t++)
+  {
+    add(texture_names[t], sprite.bytes(static_cast<TextureTypes>(t)), false);
+  }
+  return usage;
+}
+
+QList<BufferUsage> ImageProcessor::memory_usage()
+{
+  if (try_lock_maps())
+  {
+    last_usage = measure();
+    unlock_maps();
+  }
+  return last_usage;
+}
+
+qint64 ImageProcessor::release_intermediates()
+{
+  if (!try_lock_maps())
+    return 0;
+
+  qint64 released = 0;
+  for (const BufferUsage &buffer : measure())
+  {
+    if (buffer.intermediate)
+      released += buffer.bytes;
+  }
+
+  stage_cache.clear();
+  {
+    QMutexLocker locker(&frame_mutex);
+    frame_runs.clear();
+    hash_cache.clear();
+  }
+  {
+    QMutexLocker locker(&heightmap_mutex);
+    m_heightmap.reset();
+  }
+  /* Missing inputs make the next normal run a full one */
+  m_emboss_normal.reset();
+  m_distance_normal.reset();
+  m_height_ov.reset();
+  m_height_in.reset();
+  height_tags.clear();
+  normal_tags.clear();
+  /* Back buffers are rebuilt from the published maps */
+  for (ComposedMap *map : {&composed_normal, &composed_parallax, &composed_specular, &composed_occlusion})
+  {
+    map->release_back();
+  }
+  sprite.release_planes();
+  /* Previews are in use outside the lock, only their insides go */
+  if (preview_mutex.tryLock())
+  {
+    for (PreviewLevel &level : previews)
+    {
+      if (level.processor)
+        level.processor->release_intermediates();
+    }
+    preview_mutex.unlock();
+  }
+
+  last_usage = measure();
+  unlock_maps();
+  return released;
 }
 
 int ImageProcessor::loadImage(QString fileName, QImage image, QString basePath)
@@ -156,115 +349,241 @@ int ImageProcessor::loadImage(QString fileName, QImage image, QString basePath)
   sprite.set_image(TextureTypes::Heightmap, image);
   sprite.set_image(TextureTypes::SpecularBase, image);
   sprite.set_image(TextureTypes::OcclussionBase, image);
-  QImage n(3 * image.size(), QImage::Format_RGBA8888_Premultiplied);
-  n.fill(0);
-  sprite.set_image(TextureTypes::Neighbours, n);
-  n = QImage(image.width(), image.height(),
-             QImage::Format_RGBA8888_Premultiplied);
-  n.fill(0);
-  sprite.set_image(TextureTypes::NormalOverlay, n);
-  sprite.set_image(TextureTypes::HeightmapOverlay, n);
-  sprite.set_image(TextureTypes::SpecularOverlay, n);
-  sprite.set_image(TextureTypes::ParallaxOverlay, n);
-  sprite.set_image(TextureTypes::OcclussionOverlay, n);
-  sprite.set_image(TextureTypes::TextureOverlay, n);
+  /* Overlay tiles are allocated by the first stroke over them */
+  const TiledOverlay blank(image.size()), blank_gray(image.size(), 2);
+  sprite.set_overlay(TextureTypes::NormalOverlay, blank);
+  sprite.set_overlay(TextureTypes::HeightmapOverlay, blank_gray);
+  sprite.set_overlay(TextureTypes::SpecularOverlay, blank_gray);
+  sprite.set_overlay(TextureTypes::ParallaxOverlay, blank_gray);
+  sprite.set_overlay(TextureTypes::OcclussionOverlay, blank_gray);
+  sprite.set_overlay(TextureTypes::TextureOverlay, blank);
   sprite.fileName = fileName;
   set_current_frame_id(0);
-  get_normal_overlay();
 
   if (!customHeightMap)
   {
     fill_neighbours(fileName, image);
   }
+  create_previews();
 
-  recalculate_timer.start();
+  schedule(ProcessedImage::Normal);
+  schedule(ProcessedImage::Parallax);
+  schedule(ProcessedImage::Specular);
+  schedule(ProcessedImage::Occlusion);
   return 0;
 }
 
-void ImageProcessor::set_current_heightmap(int id)
+/* Heightmap the stages of a run read. Every map branch asks for it, but
+ * it is only built once per source version; the branches then share it
+ * and run without holding any lock. */
+HeightmapSnapshot ImageProcessor::heightmap_source()
 {
+  const NeighbourCanvas canvas = tileable ? neighbour_canvas() : NeighbourCanvas();
+  /* Taken before the planes: if the texture changes in between, the key is
+   * just never seen again. */
+  StageKey key(static_cast<int>(Stage::Heightmap));
+  key << sprite.cache_key(TextureTypes::Heightmap) << tileable << canvas.version() << h_frames
+      << v_frames;
 
- // if (id == current_heightmap_id) return;
-
-  current_heightmap_id = id;
+  QMutexLocker locker(&heightmap_mutex);
+  if (m_heightmap && m_heightmap->key == key.value())
+    return m_heightmap;
 
+  auto src = std::make_shared<HeightmapSource>();
+  src->key = key.value();
+  /* Planes are cached by the texture, so this doesn't convert the
+   * heightmap again for other processors sharing it. */
+  src->planes = sprite.get_planar(TextureTypes::Heightmap, QImage::Format_RGBA8888);
+  src->gray_planes = sprite.get_planar(TextureTypes::Heightmap, QImage::Format_Grayscale8);
+  src->occupancy = Occupancy(src->planes, 3, src->gray_planes);
+  src->neighbours = canvas;
+  src->layout = FrameLayout(sprite.size(), h_frames, v_frames, tileable);
+  src->hashes = source_hashes(TextureTypes::Heightmap, QImage::Format_RGBA8888, src->layout, canvas);
+  m_heightmap = src;
+  return m_heightmap;
+}
 
-  if (tileable)
-    sprite.get_image(TextureTypes::Neighbours, &heightmap);
-  else
-    sprite.get_image(TextureTypes::Heightmap, &heightmap);
+CImg<uchar> HeightmapSource::crop(const PlanarImage &p, int c, const QRect &r) const
+{
+  if (layout.canvas())
+    return neighbours.read(r, p, c);
+  return p.channel_view(c).get_crop(r.left(), r.top(), r.right(), r.bottom());
+}
 
-  current_heightmap = QImage2CImg(heightmap.convertToFormat(QImage::Format_RGBA8888));
-  m_gray = QImage2CImg(heightmap.convertToFormat(QImage::Format_Grayscale8));
+/* The neighbours of the frames, for the current sprite and framing. The
+ * canvas is only a description, so a copy costs next to nothing. */
+NeighbourCanvas ImageProcessor::neighbour_canvas()
+{
+  QMutexLocker locker(&neighbours_mutex);
+  if (!neighbours.matches(sprite.size(), h_frames, v_frames))
+  {
+    neighbours = NeighbourCanvas(sprite.size(), h_frames, v_frames);
+  }
+  return neighbours;
 }
 
-void ImageProcessor::calculate()
+/* Content hashes of the frame sources of a stage reading type: the frames
+ * themselves, or their blocks of the neighbours canvas. */
+QVector<quint64> ImageProcessor::source_hashes(TextureTypes type, QImage::Format format,
+                                               const FrameLayout &layout, const NeighbourCanvas &canvas)
 {
-  set_current_heightmap(current_frame_id);
-  if (has_normal || has_parallax) calculate_distance();
-  calculate_heightmap();
-  if (has_normal) generate_normal_map();
-  if (has_parallax) calculate_parallax();
-  if (has_specular) calculate_specular();
-  if (has_occlusion) calculate_occlusion();
+  const FrameLayout frames(layout.sprite_size(), h_frames, v_frames, false);
+  QVector<quint64> hashes = frame_hashes(type, format, frames, false);
+  return layout.canvas() ? canvas.block_hashes(hashes) : hashes;
 }
 
-void ImageProcessor::recalculate()
+/* Content hashes of the frames of a texture, over the sources or the
+ * frames of layout. They only change with the texture, so they are kept
+ * for its cache key. */
+QVector<quint64> ImageProcessor::frame_hashes(TextureTypes type, QImage::Format format,
+                                              const FrameLayout &layout, bool source)
 {
-  if (normal_counter > 0 && normal_mutex.tryLock())
+  QRect first = layout.frame(0);
+  StageKey key(static_cast<int>(type));
+  key << sprite.cache_key(type) << static_cast<int>(format) << layout.sprite_size().width()
+      << layout.sprite_size().height() << first.width() << first.height() << layout.canvas()
+      << source;
   {
+    QMutexLocker locker(&frame_mutex);
+    if (hash_cache.contains(key.value()))
+      return hash_cache.value(key.value());
+  }
 
-    normal_mutex.unlock();
-    bool updateEnhance = enhance_requested, updateBump = bump_requested, updateDistance = distance_requested;
-    QRect rect = rect_requested;
-    QtConcurrent::run([=](){this->generate_normal_map(updateEnhance, updateBump, updateDistance, rect);});
-    enhance_requested = bump_requested = distance_requested = false;
-    rect_requested = QRect(0, 0, 0, 0);
-    normal_counter = 0;
+  QVector<QRect> regions;
+  for (int i = 0; i < layout.count(); i++)
+  {
+    regions.append(source ? layout.source(i) : layout.frame(i));
   }
-  if (specular_counter > 0)
+  QVector<quint64> hashes = region_hashes(sprite.get_planar(type, format), regions);
+
+  QMutexLocker locker(&frame_mutex);
+  if (hash_cache.size() >= 32)
   {
-    QtConcurrent::run([this](){this->calculate_specular();});
-    specular_counter = 0;
+    hash_cache.clear();
   }
-  if (parallax_counter > 0)
+  hash_cache.insert(key.value(), hashes);
+  return hashes;
+}
+
+/* Bound of the x and y normal components calculate_normal produces at
+ * depth: one sided gradients reach 4 * 255, scaled by depth / 100 / 255.
+ * z is always 1. */
+static float normal_bound(int depth)
+{
+  return std::max(4.0f * std::abs(depth) / 100.0f, 1.0f);
+}
+
+/* Tag of every frame of a frame stage output: equal tags, equal pixels */
+static QVector<quint64> frame_tags(const StageKey &params, const QVector<quint64> &hashes)
+{
+  QVector<quint64> tags(hashes.size());
+  for (int i = 0; i < hashes.size(); i++)
+  {
+    StageKey tag = params;
+    tag << hashes[i];
+    tags[i] = tag.value();
+  }
+  return tags;
+}
+
+/* Output of the frame stage params for a source whose frames hash to
+ * hashes, with values in [lo, hi]. Frames that hash as in the previous
+ * output of the same node and parameters are copied from it; fn(i, out)
+ * computes the others into source(i) of out, or frame(i) when
+ * !source_space. Frames run in parallel, the loops inside each frame
+ * serially then. */
+StageImage ImageProcessor::update_frames(const StageKey &params, const QVector<quint64> &hashes,
+                                         const FrameLayout &layout, bool source_space,
+                                         int channels, float lo, float hi,
+                                         const std::function<void(int, CompactImage &)> &fn)
+{
+  const QSize size = source_space ? layout.source_size() : layout.sprite_size();
+  FrameRun last;
   {
-    QtConcurrent::run([this](){this->calculate_parallax();});
-    parallax_counter = 0;
+    QMutexLocker locker(&frame_mutex);
+    last = frame_runs.value(params.node());
   }
-  if (occlussion_counter > 0)
+  bool reuse = last.image && last.params == params.value() && last.hashes.size() == hashes.size() &&
+               last.image->width() == size.width() && last.image->height() == size.height() &&
+               last.image->spectrum() == channels;
+
+  auto out = std::make_shared<CompactImage>(size.width(), size.height(), channels, lo, hi);
+  QVector<int> dirty;
+  for (int i = 0; i < hashes.size(); i++)
   {
-    QtConcurrent::run([this](){this->calculate_occlusion();});
-    occlussion_counter = 0;
+    if (reuse && last.hashes[i] == hashes[i])
+    {
+      out->copy_region(*last.image, source_space ? layout.source(i) : layout.frame(i));
+    }
+    else
+    {
+      dirty.append(i);
+    }
   }
+
+  parallel_for(dirty.size(), dirty.size() > 1, [&](int i) {
+    if (!cancelled())
+      fn(dirty[i], *out);
+  });
+
+  /* Frames of a cancelled run may be missing */
+  if (cancelled())
+    return out;
+
+  QMutexLocker locker(&frame_mutex);
+  frame_runs.insert(params.node(), {params.value(), hashes, out});
+  return out;
 }
 
-void ImageProcessor::calculate_parallax()
+/* Blocks until the maps are done, the CLI has no event loop to schedule
+ * them from */
+void ImageProcessor::calculate()
 {
-  if (!parallax_mutex.tryLock())
-  {
-    parallax_counter = 1;
-    return;
-  }
+  calculate_heightmap();
+  if (has_normal) generate_normal_map(QRect(0, 0, 0, 0));
+  if (has_parallax) calculate_parallax();
+  if (has_specular) calculate_specular();
+  if (has_occlusion) calculate_occlusion();
+}
 
-  QImage ovi = get_parallax_overlay();
+/* Recomputes rect of map in the background, see RecomputeScheduler */
+void ImageProcessor::schedule(ProcessedImage map, QRect rect)
+{
+  RecomputeScheduler::instance().request(this, map, rect);
+}
 
-  CImg<float> ov(QImage2CImg(ovi));
-  CImg<float> alpha = ov.get_channel(3) / 255.0;
+void ImageProcessor::recalculate()
+{
+  schedule(ProcessedImage::Normal);
+  schedule(ProcessedImage::Parallax);
+  schedule(ProcessedImage::Specular);
+  schedule(ProcessedImage::Occlusion);
+}
 
-  current_parallax = modify_parallax();
+void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bool updateDistance,
+                                         QRect rect)
+{
+  Q_UNUSED(updateEnhance);
+  Q_UNUSED(updateBump);
+  Q_UNUSED(updateDistance);
+  schedule(ProcessedImage::Normal, rect);
+}
 
-  if (tileable)
-  {
+void ImageProcessor::calculate_parallax()
+{
+  parallax_mutex.lock();
 
-    QSize s = sprite.size();
-    current_parallax.crop(s.width(), s.height(), 2 * s.width() - 1, 2 * s.height() - 1);
+  QVector<quint64> tags;
+  StageImage map = modify_parallax(*heightmap_source(), &tags);
+  QImage parallax = compose_gray_map(*map, tags, TextureTypes::ParallaxOverlay, composed_parallax);
+  if (cancelled())
+  {
+    parallax_mutex.unlock();
+    return;
   }
 
-  current_parallax = (current_parallax.mul(1.0 - alpha) + ov.get_channel(0)).cut(0.0, 255.0);
-
   parallax_ready.lock();
-  sprite.set_image(TextureTypes::Parallax, CImg2QImage(current_parallax));
+  sprite.set_image(TextureTypes::Parallax, parallax);
 
   parallax_ready.unlock();
 
@@ -274,28 +593,19 @@ void ImageProcessor::calculate_parallax()
 
 void ImageProcessor::calculate_specular()
 {
-  if (!specular_mutex.tryLock())
-  {
-    specular_counter = 1;
-    return;
-  }
-
-  current_specular = modify_specular();
-  QImage ovi = get_specular_overlay();
-
-  CImg<float> ov(QImage2CImg(ovi));
-  CImg<float> alpha = ov.get_channel(3) / 255.0;
+  specular_mutex.lock();
 
-  if (tileable)
+  QVector<quint64> tags;
+  StageImage map = modify_specular(&tags);
+  QImage specular = compose_gray_map(*map, tags, TextureTypes::SpecularOverlay, composed_specular);
+  if (cancelled())
   {
-    QSize s = sprite.size();
-    current_specular.crop(s.width(), s.height(), 2 * s.width() - 1, 2 * s.height() - 1);
+    specular_mutex.unlock();
+    return;
   }
 
-  current_specular = (current_specular.mul(1.0 - alpha) + ov.get_channel(0)).cut(0.0, 255.0);
-
   specular_ready.lock();
-  sprite.set_image(TextureTypes::Specular, CImg2QImage(current_specular));
+  sprite.set_image(TextureTypes::Specular, specular);
   specular_ready.unlock();
 
   processed();
@@ -304,97 +614,485 @@ void ImageProcessor::calculate_specular()
 
 void ImageProcessor::calculate_occlusion()
 {
-  if (!occlusion_mutex.tryLock())
+  occlusion_mutex.lock();
+  QVector<quint64> tags;
+  StageImage map = modify_occlusion(*heightmap_source(), &tags);
+  QImage occlusion = compose_gray_map(*map, tags, TextureTypes::OcclussionOverlay, composed_occlusion);
+  if (cancelled())
   {
-    occlussion_counter = 1;
+    occlusion_mutex.unlock();
     return;
   }
-  current_occlusion = modify_occlusion();
-  QImage ovi = get_occlusion_overlay();
-
-  CImg<float> ov(QImage2CImg(ovi));
-  CImg<float> alpha = ov.get_channel(3) / 255.0;
-
-  /* TODO IMPORTANT make occlussion tileable */
-  QSize s = sprite.size();
-  if (tileable)
-  {
-    current_occlusion.crop(s.width(), s.height(), 2 * s.width() - 1, 2 * s.height() - 1);
-  }
-
-  current_occlusion = (current_occlusion.mul(1.0 - alpha) + ov.get_channel(0)).cut(0.0, 255.0);
   occlussion_ready.lock();
-  sprite.set_image(TextureTypes::Occlussion, CImg2QImage(current_occlusion));
+  sprite.set_image(TextureTypes::Occlussion, occlusion);
   occlussion_ready.unlock();
   processed();
   occlusion_mutex.unlock();
 }
 
-void ImageProcessor::calculate_heightmap()
+/* Sprites smaller than this are computed at full resolution right away */
+static const qint64 preview_min_pixels = 512 * 512;
+
+/* A length in pixels, or a per pixel slope, at 1 / factor resolution */
+static int preview_length(int length, int factor)
 {
-  /* Implement this ? */
+  if (length == 0)
+    return 0;
+  int scaled = std::max((std::abs(length) + factor / 2) / factor, 1);
+  return length < 0 ? -scaled : scaled;
 }
 
-int ImageProcessor::fill_neighbours(QString fileName, QImage image)
+/* The copies of the preview levels are QObjects, so they are made here on
+ * the thread of this processor, not in the pool jobs that use them. Their
+ * memory is accounted with this processor. The CLI shows no previews. */
+void ImageProcessor::create_previews()
 {
-  QSize s = sprite.size();
-  image = image.scaled(s);
+  const QSize s = sprite.size();
+  if (!progressive_preview || qint64(s.width()) * s.height() < preview_min_pixels)
+    return;
+  if (!qobject_cast<QApplication *>(QCoreApplication::instance()))
+    return;
 
-  for (int x = 0; x < 3; x++)
+  QMutexLocker locker(&preview_mutex);
+  for (PreviewLevel &level : previews)
   {
-    for (int y = 0; y < 3; y++)
-      set_neighbour_image(fileName, image, x, y);
+    if (level.processor)
+      continue;
+    level.processor.reset(new ImageProcessor(nullptr, false));
+    level.processor->progressive_preview = false;
+    level.processor->moveToThread(thread());
+  }
+}
+
+/* Updates the processor of a preview level: the textures are scaled down
+ * when they changed, the parameters are copied with lengths scaled, so the
+ * maps look like the full resolution ones. Null when the level has none. */
+ImageProcessor *ImageProcessor::prepare_preview(PreviewLevel &level)
+{
+  ImageProcessor *p = level.processor.get();
+  if (!p)
+    return nullptr;
+  const int f = level.factor;
+  const QSize s = sprite.size();
+  const QSize size((s.width() + f - 1) / f, (s.height() + f - 1) / f);
+
+  static const TextureTypes sources[] = {
+      TextureTypes::Diffuse,          TextureTypes::Heightmap,        TextureTypes::SpecularBase,
+      TextureTypes::NormalOverlay,    TextureTypes::HeightmapOverlay, TextureTypes::SpecularOverlay,
+      TextureTypes::ParallaxOverlay,  TextureTypes::OcclussionOverlay};
+  for (TextureTypes type : sources)
+  {
+    quint64 key = sprite.cache_key(type);
+    if (level.keys.contains(static_cast<int>(type)) && level.keys.value(static_cast<int>(type)) == key)
+      continue;
+    level.keys.insert(static_cast<int>(type), key);
+
+    if (is_overlay(type) && sprite.get_overlay(type).is_empty())
+    {
+      p->sprite.set_overlay(type, TiledOverlay(size, overlay_channels(type)));
+      continue;
+    }
+    QImage image;
+    sprite.get_image(type, &image);
+    if (!image.isNull())
+    {
+      QSize target(image.width() * size.width() / s.width(), image.height() * size.height() / s.height());
+      image = image.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+                  .convertToFormat(image.format());
+    }
+    p->sprite.set_image(type, image);
   }
 
-  calculate();
+  p->h_frames = h_frames;
+  p->v_frames = v_frames;
+  p->tileable = tileable;
+  const NeighbourCanvas canvas = neighbour_canvas();
+  if (level.keys.value(static_cast<int>(TextureTypes::Neighbours)) != canvas.version())
+  {
+    level.keys.insert(static_cast<int>(TextureTypes::Neighbours), canvas.version());
+    QMutexLocker locker(&p->neighbours_mutex);
+    p->neighbours = canvas.scaled(size);
+  }
+  p->height_overlay_depth = preview_length(height_overlay_depth, f);
+
+  p->normal_depth = preview_length(normal_depth, f);
+  p->normal_blur_radius = preview_length(normal_blur_radius, f);
+  p->normal_bisel_depth = normal_bisel_depth;
+  p->normal_bisel_distance = preview_length(normal_bisel_distance, f);
+  p->normal_bisel_blur_radius = preview_length(normal_bisel_blur_radius, f);
+  p->normal_bisel_soft = normal_bisel_soft;
+  p->normalInvertX = normalInvertX;
+  p->normalInvertY = normalInvertY;
+  p->normalInvertZ = normalInvertZ;
+
+  p->parallax_type = parallax_type;
+  p->parallax_max = parallax_max;
+  p->parallax_min = parallax_min;
+  p->parallax_invert = parallax_invert;
+  p->parallax_focus = preview_length(parallax_focus, f);
+  p->parallax_soft = preview_length(parallax_soft, f);
+  p->parallax_quantization = parallax_quantization;
+  p->parallax_brightness = parallax_brightness;
+  p->parallax_contrast = parallax_contrast;
+  p->parallax_erode_dilate = preview_length(parallax_erode_dilate, f);
+
+  p->specular_blur = preview_length(specular_blur, f);
+  p->specular_bright = specular_bright;
+  p->specular_contrast = specular_contrast;
+  p->specular_thresh = specular_thresh;
+  p->specular_invert = specular_invert;
+
+  p->occlusion_blur = preview_length(occlusion_blur, f);
+  p->occlusion_bright = occlusion_bright;
+  p->occlusion_contrast = occlusion_contrast;
+  p->occlusion_thresh = occlusion_thresh;
+  p->occlusion_invert = occlusion_invert;
+  p->occlusion_distance_mode = occlusion_distance_mode;
+  p->occlusion_distance = preview_length(occlusion_distance, f);
+  return p;
+}
 
-  return 0;
+/* Computes map at 1/4 and then 1/2 of the resolution and publishes each
+ * result scaled up, so a change shows at once on big sprites while the
+ * full resolution map follows. Stops when the job is cancelled. */
+void ImageProcessor::publish_previews(ProcessedImage map)
+{
+  const QSize s = sprite.size();
+  if (!progressive_preview || qint64(s.width()) * s.height() < preview_min_pixels)
+    return;
+
+  TextureTypes type;
+  QMutex *ready;
+  switch (map)
+  {
+    case ProcessedImage::Normal:
+      type = TextureTypes::Normal;
+      ready = &normal_ready;
+      break;
+    case ProcessedImage::Parallax:
+      type = TextureTypes::Parallax;
+      ready = &parallax_ready;
+      break;
+    case ProcessedImage::Specular:
+      type = TextureTypes::Specular;
+      ready = &specular_ready;
+      break;
+    case ProcessedImage::Occlusion:
+      type = TextureTypes::Occlussion;
+      ready = &occlussion_ready;
+      break;
+    default:
+      return;
+  }
+
+  for (PreviewLevel &level : previews)
+  {
+    /* Previews of other maps wait for this one, or they would change the
+     * copy's parameters under it */
+    QMutexLocker run(&level.run_mutex);
+    preview_mutex.lock();
+    ImageProcessor *p = prepare_preview(level);
+    preview_mutex.unlock();
+    if (!p)
+      return;
+    switch (map)
+    {
+      case ProcessedImage::Normal:
+        p->generate_normal_map(QRect(0, 0, 0, 0));
+        break;
+      case ProcessedImage::Parallax:
+        p->calculate_parallax();
+        break;
+      case ProcessedImage::Specular:
+        p->calculate_specular();
+        break;
+      default:
+        p->calculate_occlusion();
+        break;
+    }
+    if (cancelled())
+      return;
+
+    QImage image;
+    p->sprite.get_image(type, &image);
+    if (image.isNull())
+      return;
+    image = image.scaled(s, Qt::IgnoreAspectRatio, Qt::SmoothTransformation).convertToFormat(image.format());
+
+    ready->lock();
+    sprite.set_image(type, image);
+    ready->unlock();
+    processed();
+  }
 }
 
-void ImageProcessor::reset_neighbours()
+/* Composes map, a frame stage output with the given frame tags, under the
+ * overlay into last. Only frames whose tag or overlay changed since the
+ * previous call are composed again. */
+QImage ImageProcessor::compose_gray_map(const CompactImage &map, const QVector<quint64> &tags,
+                                        TextureTypes overlay, ComposedMap &last)
 {
-  QImage diffuse;
-  QImage neighbours;
-  sprite.get_image(TextureTypes::Neighbours, &neighbours);
-  sprite.get_image(TextureTypes::Diffuse, &diffuse);
-  float w = (float)texture.width() / h_frames;
-  float h = (float)texture.height() / v_frames;
-  QRect neighbor_rect(0, 0, w, h);
-  QPainter p(&neighbours);
-  p.setCompositionMode(QPainter::CompositionMode_Source);
-  int base_top = 0, base_left = 0;
-
-  neighbours.fill(Qt::transparent);
-  for (int i = 0; i < h_frames; i++)
-  {
-    base_left = i * w * 3;
-    for (int j = 0; j < v_frames; j++)
+  QSize s = sprite.size();
+  const FrameLayout layout(s, h_frames, v_frames, false);
+
+  const TiledOverlay ov = sprite.get_overlay(overlay);
+  bool has_overlay = ov.size() == s && !ov.is_empty();
+  QVector<quint64> ov_hashes(layout.count(), 0);
+  for (int i = 0; i < layout.count() && has_overlay; i++)
+  {
+    ov_hashes[i] = ov.hash(layout.frame(i));
+  }
+
+  bool fresh = last.front().size() != s || last.tags.size() != layout.count() ||
+               tags.size() != layout.count();
+  QImage &image = last.begin(s, QImage::Format_Grayscale8);
+  QVector<quint64> composed(layout.count());
+  QVector<int> dirty;
+  QVector<QRect> dirty_rects;
+  for (int i = 0; i < layout.count(); i++)
+  {
+    StageKey tag(static_cast<int>(overlay));
+    tag << (i < tags.size() ? tags[i] : 0) << ov_hashes[i] << has_overlay;
+    composed[i] = tag.value();
+    if (fresh || composed[i] != last.tags[i])
     {
-      base_top = j * h * 3;
-      neighbor_rect.moveLeft(base_left);
-      neighbor_rect.moveTop(base_top);
-      for (int x = -1; x <= 1; x++)
+      dirty.append(i);
+      dirty_rects.append(layout.frame(i));
+    }
+  }
+
+  uchar *out_bits = image.bits();
+  const int out_stride = image.bytesPerLine();
+  /* Value and alpha, see overlay_channels */
+  const int n = ov.channels();
+
+  foreach (int frame, dirty)
+  {
+    const QRect f = layout.frame(frame);
+    for_each_tile(f.left(), f.top(), f.right(), f.bottom(), [&](const Tile &t) {
+      float buffer[tile_width];
+      uchar ov_buffer[4 * tile_width];
+      for (int y = t.y0; y <= t.y1; y++)
       {
-        for (int y = -1; y <= 1; y++)
+        const float *src = map.span(t.x0, y, 0, t.x1 - t.x0 + 1, buffer);
+        uchar *dst = out_bits + y * out_stride + t.x0;
+        /* Unpainted overlay tiles are not blended at all */
+        const uchar *paint = has_overlay ? ov.span(t.x0, y, t.x1 - t.x0 + 1, ov_buffer) : nullptr;
+        for (int i = 0; i <= t.x1 - t.x0; i++)
         {
-          QImage neighbour = getFrameImage(i + x, j + y);
-          p.drawImage(neighbor_rect, neighbour);
-          neighbor_rect.moveTop(neighbor_rect.top() + h);
+          float v = src[i];
+          if (paint)
+          {
+            v = v * (1.0f - paint[n * i + n - 1] / 255.0f) + paint[n * i];
+          }
+          dst[i] = v <= 0.0f ? 0 : v >= 255.0f ? 255 : static_cast<uchar>(v);
         }
-        neighbor_rect.moveTop(base_top);
-        neighbor_rect.moveLeft(neighbor_rect.left() + w);
       }
+    });
+  }
+  if (cancelled())
+  {
+    /* Skipped tiles leave frames half composed, compose them all next time */
+    last.abandon(dirty_rects);
+    last.tags.clear();
+    return last.front();
+  }
+  last.tags = composed;
+  return last.finish(dirty_rects);
+}
+
+QImage &ImageProcessor::ComposedMap::begin(QSize size, QImage::Format format)
+{
+  QImage &back = buffers[1 - published];
+  const QImage &pub = buffers[published];
+  const bool catch_up = pub.size() == size && pub.format() == format;
+  if (back.size() != size || back.format() != format)
+  {
+    back = QImage(size, format);
+    lag.clear();
+    if (catch_up)
+      lag.append(pub.rect());
+  }
+  if (!catch_up)
+    lag.clear();
+
+  /* bits() only copies back if a reader still holds it from when it was
+   * published */
+  const int bytes_per_pixel = back.depth() / 8;
+  uchar *dst = back.bits();
+  const uchar *src = pub.constBits();
+  foreach (QRect r, lag)
+  {
+    for (int y = r.top(); y <= r.bottom(); y++)
+    {
+      const qsizetype offset = y * back.bytesPerLine() + r.left() * bytes_per_pixel;
+      memcpy(dst + offset, src + y * pub.bytesPerLine() + r.left() * bytes_per_pixel,
+             static_cast<size_t>(r.width()) * bytes_per_pixel);
     }
   }
+  lag.clear();
+  return back;
+}
 
-  sprite.set_image(TextureTypes::Neighbours, neighbours);
+const QImage &ImageProcessor::ComposedMap::finish(const QVector<QRect> &dirty)
+{
+  published = 1 - published;
+  lag = dirty;
+  return buffers[published];
+}
+
+void ImageProcessor::ComposedMap::abandon(const QVector<QRect> &dirty)
+{
+  lag = dirty;
+}
+
+qint64 ImageProcessor::ComposedMap::back_bytes() const
+{
+  return buffers[1 - published].sizeInBytes();
+}
+
+void ImageProcessor::ComposedMap::release_back()
+{
+  buffers[1 - published] = QImage();
+  lag.clear();
+}
+
+/* Replaces every pixel v of img, in [0, 255], by lut[v] */
+static void apply_lut(CImg<float> &img, const float *lut)
+{
+  const long size = static_cast<long>(img.size());
+  const long chunk = 65536;
+  float *data = img.data();
+  parallel_for(static_cast<int>((size + chunk - 1) / chunk), size > chunk, [&](int c) {
+    const long end = std::min(size, (c + 1) * chunk);
+    for (long i = c * chunk; i < end; i++)
+    {
+      float v = data[i] + 0.5f;
+      data[i] = lut[v <= 0.0f ? 0 : v >= 255.0f ? 255 : static_cast<int>(v)];
+    }
+  });
+}
+
+/* Writes value to channel c of the part of r in out that is not in live */
+static void fill_outside(CompactImage &out, const QRect &r, const QRect &live, int c, float value)
+{
+  if (r.isEmpty() || live.contains(r))
+    return;
+
+  std::vector<float> row(r.width(), value);
+  for (int y = r.top(); y <= r.bottom(); y++)
+  {
+    if (live.isEmpty() || y < live.top() || y > live.bottom())
+    {
+      out.write(r.left(), y, c, r.width(), row.data());
+      continue;
+    }
+    if (live.left() > r.left())
+      out.write(r.left(), y, c, live.left() - r.left(), row.data());
+    if (live.right() < r.right())
+      out.write(live.right() + 1, y, c, r.right() - live.right(), row.data());
+  }
+}
+
+/* Runs filter over area of the 8 bit plane read returns the parts of, and
+ * writes the result to area moved by offset in out. The area is padded by
+ * halo pixels of the plane, but nothing outside bounds is read, so the
+ * result matches filtering all of bounds when filter reads no further than
+ * halo. With a memory budget the area goes through in tiles, so only one
+ * small float tile exists at a time.
+ *
+ * occupancy, when given, describes the plane as read: pixels whose halo is
+ * all in flat cells of bounds get what filter makes of a flat plane, which
+ * is worked out once on a probe, and are not filtered. */
+static void filter_in_tiles(const std::function<CImg<uchar>(const QRect &)> &read, const QRect &area,
+                            const QRect &bounds, int halo,
+                            const std::function<void(CImg<float> &)> &filter, CompactImage &out,
+                            QPoint offset, const Occupancy &occupancy = Occupancy())
+{
+  if (area.isEmpty())
+    return;
+
+  int value;
+  QRect live = occupancy.varied_bounds(bounds, false, &value);
+  live = live.isEmpty() ? QRect() : live.adjusted(-halo, -halo, halo, halo).intersected(area);
+  if (value >= 0)
+  {
+    CImg<float> probe(2 * halo + 1, 2 * halo + 1, 1, 1, static_cast<float>(value));
+    filter(probe);
+    fill_outside(out, area.translated(offset), live.translated(offset), 0, probe(halo, halo));
+  }
+  else
+  {
+    live = area;
+  }
+  if (live.isEmpty())
+    return;
+
+  const int side = tiled_processing() ? budget_tile_side : std::max(live.width(), live.height());
+  for (int y0 = live.top(); y0 <= live.bottom(); y0 += side)
+  {
+    for (int x0 = live.left(); x0 <= live.right(); x0 += side)
+    {
+      if (cancelled())
+        return;
+
+      QRect tile = QRect(x0, y0, side, side).intersected(live);
+      QRect crop = tile.adjusted(-halo, -halo, halo, halo).intersected(bounds);
+
+      CImg<float> img(read(crop));
+      filter(img);
+      for (int y = tile.top(); y <= tile.bottom(); y++)
+      {
+        out.write(tile.left() + offset.x(), y + offset.y(), 0, tile.width(),
+                  img.data(tile.left() - crop.left(), y - crop.top()));
+      }
+    }
+  }
+}
+
+/* Sprite part of frame i, with halo pixels of its neighbours around when
+ * layout is a canvas, in source coordinates of layout */
+static QRect frame_crop(const FrameLayout &layout, int i, int halo)
+{
+  QRect f = layout.frame(i).translated(layout.source_offset(i));
+  return f.adjusted(-halo, -halo, halo, halo).intersected(layout.source(i));
+}
+
+void ImageProcessor::calculate_heightmap()
+{
+  /* Implement this ? */
+}
+
+/* Neighbours only describe where the pixels come from, see
+ * NeighbourCanvas, so none of the calls below paint anything. */
+
+int ImageProcessor::fill_neighbours(QString fileName, QImage image)
+{
+  Q_UNUSED(image);
+  {
+    QMutexLocker locker(&neighbours_mutex);
+    neighbours = NeighbourCanvas(sprite.size(), h_frames, v_frames);
+    /* The sprite tiles with itself */
+    neighbours.reset(true);
+  }
+  for (int x = 0; x < 3; x++)
+  {
+    for (int y = 0; y < 3; y++)
+      sprite.neighbours_paths[x][y] = fileName;
+  }
+
+  return 0;
+}
+
+void ImageProcessor::reset_neighbours()
+{
+  QMutexLocker locker(&neighbours_mutex);
+  neighbours = NeighbourCanvas(sprite.size(), h_frames, v_frames);
 }
 
 int ImageProcessor::empty_neighbour(int x, int y)
 {
-  QImage image(sprite.size(), QImage::Format_RGBA64_Premultiplied);
-  image.fill(0);
-  set_neighbour_image("", image, x, y);
+  set_neighbour_image("", QImage(), x, y);
 
   return 0;
 }
@@ -402,17 +1100,12 @@ int ImageProcessor::empty_neighbour(int x, int y)
 int ImageProcessor::set_neighbour_image(QString fileName, QImage image, int x,
                                         int y)
 {
-  QImage neighbours;
-  sprite.get_image(TextureTypes::Neighbours, &neighbours);
-  QSize s = sprite.size();
+  NeighbourCanvas canvas = neighbour_canvas();
   sprite.neighbours_paths[x][y] = fileName;
-  int aleft = x * s.width();
-  int atop = y * s.height();
-  QRect r(aleft, atop, s.width(), s.height());
-  QPainter p(&neighbours);
-  p.setCompositionMode(QPainter::CompositionMode_Source);
-  p.drawImage(r, image);
-  sprite.set_image(TextureTypes::Neighbours, neighbours);
+  canvas.set_image(x, y, image);
+
+  QMutexLocker locker(&neighbours_mutex);
+  neighbours = canvas;
 
   return 0;
 }
@@ -420,51 +1113,33 @@ int ImageProcessor::set_neighbour_image(QString fileName, QImage image, int x,
 int ImageProcessor::set_neighbour_image(QImage image, int x,
                                         int y)
 {
-  QImage neighbours;
-  sprite.get_image(TextureTypes::Neighbours, &neighbours);
+  NeighbourCanvas canvas = neighbour_canvas();
+  canvas.set_image(current_frame_id, x, y, image);
 
-  QSize s = sprite.size();
-  s.setHeight(s.height() / v_frames);
-  s.setWidth(s.width() / h_frames);
-
-  int cx, cy;
-  getFramePosition(current_frame_id, cx, cy);
-
-  cx = x + cx * 3;
-  cy = cy * 3 + y;
-
-  cx *= s.width();
-  cy *= s.height();
-  QRect r(cx, cy, s.width(), s.height());
-
-  QPainter p(&neighbours);
-  p.setCompositionMode(QPainter::CompositionMode_Source);
-  p.drawImage(r, image);
-  sprite.set_image(TextureTypes::Neighbours, neighbours);
+  QMutexLocker locker(&neighbours_mutex);
+  neighbours = canvas;
 
   return 0;
 }
 
 QImage ImageProcessor::get_neighbour(int x, int y)
 {
-  QImage neighbours;
-  sprite.get_image(TextureTypes::Neighbours, &neighbours);
-  QSize s = sprite.size();
-  s.setHeight(s.height() / v_frames);
-  s.setWidth(s.width() / h_frames);
-
-  int cx, cy;
-  getFramePosition(current_frame_id, cx, cy);
+  return neighbour_canvas().cell(current_frame_id, x, y, texture);
+}
 
-  cx = x + cx * 3;
-  cy = cy * 3 + y;
+/* The canvas as it used to be stored, for project files */
+QImage ImageProcessor::get_neighbours_canvas()
+{
+  return neighbour_canvas().to_image(texture);
+}
 
-  cx *= s.width();
-  cy *= s.height();
-  QRect r(cx, cy, s.width(), s.height());
-  QImage p = neighbours.copy(r);
+void ImageProcessor::set_neighbours_canvas(QImage canvas)
+{
+  NeighbourCanvas restored = neighbour_canvas();
+  restored.restore(canvas, texture);
 
-  return p;
+  QMutexLocker locker(&neighbours_mutex);
+  neighbours = restored;
 }
 
 QString ImageProcessor::get_specular_path()
@@ -493,7 +1168,7 @@ int ImageProcessor::loadSpecularMap(QString fileName, QImage specular)
   QSize s = sprite.size();
   specular = specular.scaled(s.width(), s.height());
   sprite.set_image(TextureTypes::SpecularBase, specular);
-  calculate();
+  schedule(ProcessedImage::Specular);
 
   return 0;
 }
@@ -514,7 +1189,9 @@ int ImageProcessor::loadHeightMap(QString fileName, QImage height)
   QSize s = sprite.size();
   height = height.scaled(s.width(), s.height());
   sprite.set_image(TextureTypes::Heightmap, height);
-  calculate();
+  schedule(ProcessedImage::Normal);
+  schedule(ProcessedImage::Parallax);
+  schedule(ProcessedImage::Occlusion);
 
   return 0;
 }
@@ -524,28 +1201,84 @@ void ImageProcessor::calculate_gradient() {}
 void ImageProcessor::calculate_texture()
 {
   sprite.get_image(TextureTypes::Diffuse, &texture);
+  /* Painting detaches texture from the diffuse, only do it for strokes */
+  const TiledOverlay overlay = sprite.get_overlay(TextureTypes::TextureOverlay);
+  if (overlay.is_empty())
+    return;
   QPainter p(&texture);
-  QImage overlay;
-  sprite.get_image(TextureTypes::TextureOverlay, &overlay);
-  p.drawImage(QPoint(0, 0), overlay);
+  overlay.paint(&p);
 }
 
-void ImageProcessor::calculate_distance()
+/* Stage nodes only read the heightmap snapshot they are given, see
+ * heightmap_source(). */
+
+/* Distances to the transparent pixels and to the edge of the frame's own
+ * source, over layout. On a canvas only distances up to the bevel distance
+ * are exact, larger ones are only known to be larger: modify_distance
+ * saturates there, so a halo of that reach around the sources does. */
+StageImage ImageProcessor::calculate_distance(const HeightmapSource &src, const FrameLayout &layout)
 {
-  m_distance = QImage2CImg(heightmap.convertToFormat(QImage::Format_RGBA8888));
-  m_distance.channel(3).threshold(0.1) * 255.0f;
-  cimg_for_borderXY(m_distance, x, y, 1) m_distance(x, y) = 0.0;
-  m_distance.distance(0.0f);
+  const int reach = normal_bisel_distance + 1;
+  StageKey params(static_cast<int>(Stage::Distance));
+  if (layout.canvas())
+  {
+    params << layout.halo() << reach;
+  }
+  StageKey key = params;
+  key << src.key;
+  return stage_cache.get(key, [&]() {
+    return update_frames(params, src.hashes, layout, true, 1, 0, unbounded,
+                         [&](int i, CompactImage &out) {
+      QRect r = layout.source(i);
+      const QRect block = src.layout.source(i);
+      const QPoint d = layout.offset_to(src.layout, i);
+      QRect crop = r.translated(d).adjusted(-reach, -reach, reach, reach).intersected(block);
+      if (!layout.canvas())
+      {
+        /* Transparent pixels are at 0. Around the opaque cells a ring of
+         * them is as close as anything further out, so the transform only
+         * needs that much. */
+        const QRect opaque = src.occupancy.opaque_bounds(crop);
+        crop = opaque.isEmpty() ? QRect() : opaque.adjusted(-1, -1, 1, 1).intersected(crop);
+        fill_outside(out, r, crop, 0, 0.0f);
+        if (crop.isEmpty())
+          return;
+        r = crop;
+      }
+      CImg<float> dist = src.crop(src.planes, 3, crop);
+      dist.threshold(0.1);
+      /* Only the edges of the source count, the halo continues elsewhere */
+      cimg_forY(dist, y)
+      {
+        if (crop.left() == block.left()) dist(0, y) = 0.0;
+        if (crop.right() == block.right()) dist(dist.width() - 1, y) = 0.0;
+      }
+      cimg_forX(dist, x)
+      {
+        if (crop.top() == block.top()) dist(x, 0) = 0.0;
+        if (crop.bottom() == block.bottom()) dist(x, dist.height() - 1) = 0.0;
+      }
+      distance_transform(dist);
+      const int x0 = r.left() + d.x() - crop.left(), y0 = r.top() + d.y() - crop.top();
+      out.draw_image(r.left(), r.top(), dist.get_crop(x0, y0, x0 + r.width() - 1, y0 + r.height() - 1));
+    });
+  });
+}
 
-  m_distance *= 1;
+/* Layout of the bevel distances: they are read around the frames by the
+ * bevel normals and the heightmap parallax, so each frame keeps the reach
+ * of both of its neighbours. */
+FrameLayout ImageProcessor::bevel_layout(const HeightmapSource &src)
+{
+  const int halo = std::max(gaussian_reach(normal_bisel_blur_radius / 3.0f) + 1,
+                            gaussian_reach(parallax_soft));
+  return FrameLayout(src.layout.sprite_size(), h_frames, v_frames, src.layout.canvas(), halo);
 }
 
 void ImageProcessor::set_normal_invert_x(bool invert)
 {
   normalInvertX = -invert * 2 + 1;
-  bump_requested = enhance_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
 }
 
 void ImageProcessor::set_name(QString name) { m_name = name; }
@@ -555,352 +1288,587 @@ QString ImageProcessor::get_name() { return m_name; }
 void ImageProcessor::set_normal_invert_y(bool invert)
 {
   normalInvertY = -invert * 2 + 1;
-  bump_requested = enhance_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
 }
 
 void ImageProcessor::set_normal_invert_z(bool invert)
 {
   normalInvertZ = -invert * 2 + 1;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
 }
 
 void ImageProcessor::set_normal_depth(int depth)
 {
   normal_depth = depth;
-  enhance_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
 }
 
 void ImageProcessor::set_normal_bisel_soft(bool soft)
 {
   normal_bisel_soft = soft;
-  bump_requested = distance_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
 }
 
 void ImageProcessor::set_normal_blur_radius(int radius)
 {
   normal_blur_radius = radius;
-  enhance_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
 }
 
 void ImageProcessor::set_normal_bisel_depth(int depth)
 {
   normal_bisel_depth = depth;
-  bump_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
 }
 
 void ImageProcessor::set_normal_bisel_distance(int distance)
 {
   normal_bisel_distance = distance;
-  bump_requested = distance_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
 }
 
 void ImageProcessor::set_tileable(bool t)
 {
   tileable = t;
-  update_tileable = bump_requested = enhance_requested = distance_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  schedule(ProcessedImage::Normal);
+  schedule(ProcessedImage::Specular);
+  schedule(ProcessedImage::Parallax);
+  schedule(ProcessedImage::Occlusion);
 }
 
 bool ImageProcessor::get_tileable() { return tileable; }
 
-CImg<float> ImageProcessor::modify_distance()
+StageImage ImageProcessor::modify_distance(const HeightmapSource &src, const FrameLayout &layout)
 {
-  CImg<float> dist(m_distance);
-
-  if (normal_bisel_distance != 0)
-  {
-    dist *= 255.0 / normal_bisel_distance;
-  }
-  else
+  StageKey params(static_cast<int>(Stage::Bevel));
+  params << normal_bisel_distance << normal_bisel_soft;
+  if (layout.canvas())
   {
-    dist.threshold(0.1f) * 255.0;
-  }
+    params << layout.halo();
+  }
+  StageKey key = params;
+  key << src.key;
+  return stage_cache.get(key, [&]() {
+    StageImage distance = calculate_distance(src, layout);
+    return update_frames(params, src.hashes, layout, true, 1, 0, 255,
+                         [&](int i, CompactImage &out) {
+      QRect r = layout.source(i);
+      if (!layout.canvas())
+      {
+        /* Distances, and so bevels, are 0 where it is transparent */
+        const QRect opaque = src.occupancy.opaque_bounds(r);
+        fill_outside(out, r, opaque, 0, 0.0f);
+        if (opaque.isEmpty())
+          return;
+        r = opaque;
+      }
+      CImg<float> dist = distance->get_crop(r.left(), r.top(), r.right(), r.bottom());
 
-  dist.cut(0, 255);
-  if (normal_bisel_soft)
-  {
-    dist = (1.0 - (dist / 255.0 - 1).pow(2)).sqrt() * 255.0;
-  }
-  return dist;
+      if (normal_bisel_distance != 0)
+      {
+        dist *= 255.0 / normal_bisel_distance;
+      }
+      else
+      {
+        dist.threshold(0.1f) * 255.0;
+      }
+
+      dist.cut(0, 255);
+      if (normal_bisel_soft)
+      {
+        dist = (1.0 - (dist / 255.0 - 1).pow(2)).sqrt() * 255.0;
+      }
+      out.draw_image(r.left(), r.top(), dist);
+    });
+  });
 }
 
-CImg<float> ImageProcessor::modify_occlusion()
+StageImage ImageProcessor::modify_occlusion(const HeightmapSource &src, QVector<quint64> *tags)
 {
-  QMutexLocker locker(&heightmap_mutex);
-  set_current_heightmap(current_frame_id);
-
-  CImg<float> occ(QImage2CImg(heightmap.convertToFormat(QImage::Format_Grayscale8)));
-  if (occlusion_invert)
+  StageKey params(static_cast<int>(Stage::Occlusion));
+  params << occlusion_invert << occlusion_distance_mode << occlusion_thresh << occlusion_distance
+         << occlusion_contrast << occlusion_bright << occlusion_blur;
+  StageKey key = params;
+  key << src.key;
+  if (tags)
   {
-    occ = 255.0f - occ;
+    *tags = frame_tags(params, src.hashes);
   }
+  /* Distances saturate at occlusion_distance, so a tile only needs the
+   * zeros that close to it */
+  int halo = gaussian_reach(occlusion_blur);
   if (occlusion_distance_mode)
   {
-    occ.threshold(occlusion_thresh) * 255.0;
-
-    if (occlusion_distance != 0)
+    halo += occlusion_distance + 1;
+  }
+  auto filter = [this](CImg<float> &occ) {
+    if (occlusion_invert)
     {
-      occ.distance(0.0);
-      occ *= 255.0 / occlusion_distance;
+      occ = 255.0f - occ;
     }
-    occ.cut(0, 255);
-    occ = (1.0 - (occ / 255.0 - 1).pow(2)).sqrt() * 255.0;
-  }
-
-  occ = occlusion_contrast * occ + occlusion_thresh * (1 - occlusion_contrast);
-  occ += occlusion_bright;
-  occ.cut(0, 255);
-  occ = occ.blur(occlusion_blur);
-  return occ;
-}
+    if (occlusion_distance_mode)
+    {
+      occ.threshold(occlusion_thresh) * 255.0;
 
-CImg<float> ImageProcessor::modify_parallax()
-{
-  QMutexLocker locker(&heightmap_mutex);
-  set_current_heightmap(current_frame_id);
+      if (occlusion_distance != 0)
+      {
+        distance_transform(occ);
+        occ *= 255.0 / occlusion_distance;
+      }
+      occ.cut(0, 255);
+      occ = (1.0 - (occ / 255.0 - 1).pow(2)).sqrt() * 255.0;
+    }
 
-  CImg<float> par(QImage2CImg(heightmap.convertToFormat(QImage::Format_Grayscale8)));
-  CImg<float> dist = modify_distance();
-  switch (parallax_type)
+    occ = occlusion_contrast * occ + occlusion_thresh * (1 - occlusion_contrast);
+    occ += occlusion_bright;
+    occ.cut(0, 255);
+    gaussian_blur(occ, occlusion_blur);
+  };
+  return stage_cache.get(key, [&]() {
+    auto gray = [&](const QRect &r) { return src.crop(src.gray_planes, 0, r); };
+    /* On a canvas the planes are read through the neighbours, the map is
+     * of the sprite only */
+    const Occupancy occupancy = src.layout.canvas() ? Occupancy() : src.occupancy;
+    return update_frames(params, src.hashes, src.layout, false, 1, 0, 255,
+                         [&](int i, CompactImage &out) {
+      filter_in_tiles(gray, frame_crop(src.layout, i, 0), src.layout.source(i), halo, filter, out,
+                      -src.layout.source_offset(i), occupancy);
+    });
+  });
+}
+
+StageImage ImageProcessor::modify_parallax(const HeightmapSource &src, QVector<quint64> *tags)
+{
+  StageKey params(static_cast<int>(Stage::Parallax));
+  params << static_cast<int>(parallax_type) << parallax_focus << parallax_max << parallax_min
+         << parallax_invert << parallax_erode_dilate << parallax_soft << parallax_contrast
+         << parallax_brightness << parallax_quantization;
+  if (parallax_type == ParallaxType::HeightMap)
+  {
+    params << normal_bisel_distance << normal_bisel_soft;
+  }
+  StageKey key = params;
+  key << src.key;
+  if (tags)
   {
-    case ParallaxType::Binary:
+    *tags = frame_tags(params, src.hashes);
+  }
+  return stage_cache.get(key, [&]() {
+    const FrameLayout bevel = bevel_layout(src);
+    StageImage dist_map;
+    if (parallax_type == ParallaxType::HeightMap)
+    {
+      dist_map = modify_distance(src, bevel);
+    }
+    float steps[256];
+    parallax_steps(steps);
+    /* Reach of the blurs and the erosion around a pixel */
+    int halo = gaussian_reach(parallax_soft);
+    if (parallax_type != ParallaxType::HeightMap)
+    {
+      halo += gaussian_reach(parallax_focus);
+    }
+    if (parallax_type == ParallaxType::Binary)
     {
-      par.blur(parallax_focus);
-      par.threshold(parallax_max).normalize(0, 255);
-      par -= parallax_min;
+      halo += std::abs(parallax_erode_dilate);
+    }
+    /* par is read around r, dist at the same place in the bevel layout */
+    auto filter = [&](CImg<float> &par, const CImg<float> &dist) {
+      switch (parallax_type)
+      {
+        case ParallaxType::Binary:
+        {
+          gaussian_blur(par, parallax_focus);
+          par.threshold(parallax_max).normalize(0, 255);
+          par -= parallax_min;
+
+          if (!parallax_invert)
+          {
+            par = 255.0 - par;
+          }
+
+          if (parallax_erode_dilate > 0)
+          {
+            dilate(par, parallax_erode_dilate, parallax_erode_dilate);
+          }
+          else
+          {
+            erode(par, -parallax_erode_dilate, -parallax_erode_dilate);
+          }
 
-      if (!parallax_invert)
+          gaussian_blur(par, parallax_soft);
+          break;
+        }
+        case ParallaxType::HeightMap:
+        {
+          par = (par + dist - 1) / 2.0 + 0.5;
+          par = parallax_contrast * par + parallax_max * (1 - parallax_contrast);
+          par += parallax_brightness;
+          gaussian_blur(par, parallax_soft);
+          if (parallax_invert)
+          {
+            par = 255.0 - par;
+          }
+          break;
+        }
+        case ParallaxType::Quantization:
+        case ParallaxType::Intervals:
+        {
+          gaussian_blur(par, parallax_focus);
+          apply_lut(par, steps);
+          gaussian_blur(par, parallax_soft);
+          break;
+        }
+      }
+      par.cut(0, 255);
+    };
+    /* Flat cells are fast filled, see filter_in_tiles. The bevel distances
+     * are only flat (0) where it is transparent, and the binary mode
+     * normalizes over the frame, so it needs all of it flat. */
+    const bool transparent = parallax_type == ParallaxType::HeightMap;
+    const int probe_side = 2 * halo + 1;
+    return update_frames(params, src.hashes, src.layout, false, 1, 0, 255,
+                         [&](int i, CompactImage &out) {
+      const QRect f = src.layout.frame(i);
+      QRect live = f;
+      int value = -1;
+      if (!src.layout.canvas())
       {
-        par = 255.0 - par;
+        const QRect varied = src.occupancy.varied_bounds(f, transparent, &value);
+        live = varied.isEmpty() ? QRect() : varied.adjusted(-halo, -halo, halo, halo).intersected(f);
+        if (parallax_type == ParallaxType::Binary && !live.isEmpty())
+          value = -1;
       }
-
-      if (parallax_erode_dilate > 0)
+      if (value < 0)
       {
-        par.dilate(parallax_erode_dilate, parallax_erode_dilate);
+        live = f;
       }
       else
       {
-        par.erode(-parallax_erode_dilate, -parallax_erode_dilate);
+        CImg<float> probe(probe_side, probe_side, 1, 1, static_cast<float>(value));
+        filter(probe, CImg<float>(probe_side, probe_side, 1, 1, 0.0f));
+        fill_outside(out, f, live, 0, probe(halo, halo));
+        if (live.isEmpty())
+          return;
       }
 
-      par.blur(parallax_soft);
-      break;
-    }
-    case ParallaxType::HeightMap:
-    {
-      par = (par + dist - 1) / 2.0 + 0.5;
-      par = parallax_contrast * par + parallax_max * (1 - parallax_contrast);
-      par += parallax_brightness;
-      par.blur(parallax_soft);
-      if (parallax_invert)
+      /* live is in sprite coordinates, the same as source ones off a canvas */
+      const QRect area = live.translated(src.layout.source_offset(i));
+      const QRect r = area.adjusted(-halo, -halo, halo, halo).intersected(src.layout.source(i));
+      CImg<float> par(src.crop(src.gray_planes, 0, r));
+      CImg<float> dist;
+      if (parallax_type == ParallaxType::HeightMap)
       {
-        par = 255.0 - par;
+        const QRect d = r.translated(src.layout.offset_to(bevel, i));
+        dist = dist_map->get_crop(d.left(), d.top(), d.right(), d.bottom());
       }
-      break;
-    }
-    case ParallaxType::Intervals:
-    {
-      break;
-    }
-    case ParallaxType::Quantization:
+      filter(par, dist);
+      const QPoint o = area.topLeft() - r.topLeft();
+      out.draw_image(live.left(), live.top(),
+                     par.get_crop(o.x(), o.y(), o.x() + live.width() - 1, o.y() + live.height() - 1));
+    });
+  });
+}
+
+StageImage ImageProcessor::modify_specular(QVector<quint64> *tags)
+{
+  const NeighbourCanvas canvas = tileable ? neighbour_canvas() : NeighbourCanvas();
+  StageKey params(static_cast<int>(Stage::Specular));
+  params << tileable << specular_contrast << specular_thresh << specular_bright << specular_blur
+         << specular_invert;
+  StageKey key = params;
+  /* Frames are filtered within their own bounds, so the framing is part
+   * of the key like it is of heightmap_source() */
+  key << sprite.cache_key(TextureTypes::SpecularBase) << canvas.version() << h_frames << v_frames;
+
+  PlanarImage planes = sprite.get_planar(TextureTypes::SpecularBase, QImage::Format_Grayscale8);
+  const FrameLayout layout(sprite.size(), h_frames, v_frames, tileable);
+  QVector<quint64> hashes = source_hashes(TextureTypes::SpecularBase, QImage::Format_Grayscale8, layout,
+                                          canvas);
+  if (tags)
+  {
+    *tags = frame_tags(params, hashes);
+  }
+  auto filter = [this](CImg<float> &img_float) {
+    img_float = specular_contrast * img_float + specular_thresh * (1 - specular_contrast);
+    img_float += specular_bright;
+    img_float.cut(0, 255);
+
+    gaussian_blur(img_float, specular_blur);
+
+    if (specular_invert)
     {
-      //TODO: Important, check if i can do it now with CImg
-      break;
+      img_float = 255.0 - img_float;
     }
-  }
-  par.cut(0, 255);
-  return par;
+  };
+  return stage_cache.get(key, [&]() {
+    auto gray = [&](const QRect &r) {
+      if (layout.canvas())
+        return canvas.read(r, planes);
+      return planes.view().get_crop(r.left(), r.top(), r.right(), r.bottom());
+    };
+    /* Of the gray planes only, the filter doesn't look at alpha */
+    const Occupancy occupancy = layout.canvas() ? Occupancy() : Occupancy(PlanarImage(), 0, planes);
+    return update_frames(params, hashes, layout, false, 1, 0, 255, [&](int i, CompactImage &out) {
+      filter_in_tiles(gray, frame_crop(layout, i, 0), layout.source(i), gaussian_reach(specular_blur),
+                      filter, out, -layout.source_offset(i), occupancy);
+    });
+  });
 }
 
-CImg<float> ImageProcessor::modify_specular()
+void ImageProcessor::set_normal_bisel_blur_radius(int radius)
 {
-  if (tileable)
-    sprite.get_image(TextureTypes::Neighbours, &specular);
-  else
-    sprite.get_image(TextureTypes::SpecularBase, &specular);
-  specular = specular.convertToFormat(QImage::Format_Grayscale8);
-  CImg<uchar> img = QImage2CImg(specular);
-  CImg<float> img_float(img);
-  img_float = specular_contrast * img_float + specular_thresh * (1 - specular_contrast);
-  img_float += specular_bright;
-  img_float.cut(0, 255);
-
-  img_float.blur(specular_blur);
-
-  if (specular_invert)
-  {
-    img_float = 255.0 - img_float;
-  }
+  normal_bisel_blur_radius = radius;
+  schedule(ProcessedImage::Normal);
+}
 
-  return img_float;
+/* Reads regions of a stage intermediate */
+static RegionReader region_reader(const CompactImage &img)
+{
+  return [&img](const QRect &r) { return img.get_crop(r.left(), r.top(), r.right(), r.bottom()); };
 }
 
-void ImageProcessor::set_normal_bisel_blur_radius(int radius)
+StageImage ImageProcessor::calculate_emboss_normal(const HeightmapSource &src, QVector<quint64> *tags)
 {
-  normal_bisel_blur_radius = radius;
-  bump_requested = true;
-  rect_requested = QRect(0, 0, 0, 0);
-  normal_counter = 1;
+  StageKey params(static_cast<int>(Stage::EmbossNormal));
+  params << normal_depth << normal_blur_radius;
+  StageKey key = params;
+  key << src.key;
+  if (tags)
+  {
+    *tags = frame_tags(params, src.hashes);
+  }
+  return stage_cache.get(key, [&]() {
+    const float bound = normal_bound(normal_depth * 10);
+    return update_frames(params, src.hashes, src.layout, false, 3, -bound, bound,
+                         [&](int i, CompactImage &out) {
+      auto gray = [&](const QRect &r) { return CImg<float>(src.crop(src.gray_planes, 0, r)); };
+      calculate_normal(gray, src.layout, src, normal_depth * 10, normal_blur_radius, out,
+                       src.layout.frame(i));
+    });
+  });
+}
+
+StageImage ImageProcessor::calculate_bevel_normal(const HeightmapSource &src, QVector<quint64> *tags)
+{
+  StageKey params(static_cast<int>(Stage::BevelNormal));
+  params << normal_bisel_distance << normal_bisel_soft << normal_bisel_depth
+         << normal_bisel_blur_radius;
+  StageKey key = params;
+  key << src.key;
+  if (tags)
+  {
+    *tags = frame_tags(params, src.hashes);
+  }
+  return stage_cache.get(key, [&]() {
+    const FrameLayout layout = bevel_layout(src);
+    StageImage bevel = modify_distance(src, layout);
+    const float bound = normal_bound(normal_bisel_depth * normal_bisel_distance);
+    return update_frames(params, src.hashes, src.layout, false, 3, -bound, bound,
+                         [&](int i, CompactImage &out) {
+      calculate_normal(region_reader(*bevel), layout, src,
+                       normal_bisel_depth * normal_bisel_distance, normal_bisel_blur_radius, out,
+                       src.layout.frame(i));
+    });
+  });
 }
 
-void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bool updateDistance, QRect rect)
+void ImageProcessor::generate_normal_map(QRect rect)
 {
-  if (!normal_mutex.tryLock())
+  normal_mutex.lock();
+  const HeightmapSnapshot src = heightmap_source();
+  const QSize s = sprite.size();
+  const QRect sprite_rect(0, 0, s.width(), s.height());
+  if (s.isEmpty())
   {
-    normal_counter = 1;
-    enhance_requested = bump_requested = distance_requested = true;
-    rect_requested = rect_requested.united(rect);
+    normal_mutex.unlock();
     return;
   }
-  QMutexLocker hlocker(&heightmap_mutex);
+
   /* Calculate rects to update */
   QList<QRect> rlist;
   bool diagonal = true;
   if (rect != QRect(0, 0, 0, 0))
   {
-    // Adjust for 1px blur
-    rect.adjust(0, 0, 1, 1);
-    rlist.append(rect.intersected(texture.rect()));
+    // Grow by the 1px reach of the gradient
+    rect.adjust(-1, -1, 1, 1);
+    rlist.append(rect.intersected(sprite_rect));
 
-    rect.moveTo(WrapCoordinate(rect.left(), texture.width()),
-                WrapCoordinate(rect.top(), texture.height()));
+    rect.moveTo(WrapCoordinate(rect.left(), s.width()),
+                WrapCoordinate(rect.top(), s.height()));
 
     if (!rlist.contains(rect))
-      rlist.append(rect.intersected(texture.rect()));
+      rlist.append(rect.intersected(sprite_rect));
 
-    if (rect.right() > texture.rect().right() && tileX)
+    if (rect.right() > sprite_rect.right() && tileX)
       rlist.prepend(
-          QRect(0, rect.top(), WrapCoordinate(rect.right(), texture.width()), rect.height())
-              .intersected(texture.rect()));
+          QRect(0, rect.top(), WrapCoordinate(rect.right(), s.width()), rect.height())
+              .intersected(sprite_rect));
     else
       diagonal = false;
 
-    if (rect.bottom() > texture.rect().bottom() && tileY)
+    if (rect.bottom() > sprite_rect.bottom() && tileY)
       rlist.append(QRect(rect.left(), 0, rect.width(),
-                         WrapCoordinate(rect.bottom(), texture.height()))
-                       .intersected(texture.rect()));
+                         WrapCoordinate(rect.bottom(), s.height()))
+                       .intersected(sprite_rect));
     else
       diagonal = false;
 
     if (diagonal)
-      rlist.append(QRect(0, 0, WrapCoordinate(rect.right(), texture.width()),
-                         WrapCoordinate(rect.bottom(), texture.height()))
-                       .intersected(texture.rect()));
+      rlist.append(QRect(0, 0, WrapCoordinate(rect.right(), s.width()),
+                         WrapCoordinate(rect.bottom(), s.height()))
+                       .intersected(sprite_rect));
 
     rlist.removeAll(QRect(0, 0, 0, 0));
   }
-  if (rlist.count() == 0)
-    rlist.append(QRect(0, 0, 0, 0));
-
-  QImage heightOverlay = get_heightmap_overlay();
-  CImg<float> heightOv = QImage2CImg(heightOverlay);
-  if (heightOv.is_empty())
-  {
-    normal_mutex.unlock();
-    return;
-  }
-  heightOv = heightOv.mul(heightOv.get_channel(3) / 255.0);
 
-  //for (int i = 0; i < rlist.count(); i++)
-  {
-    m_height_ov = calculate_normal(heightOv.channel(0), 5000, 0);
-  }
+  /* Only the parts whose key changed are recomputed, see Stage */
+  QVector<quint64> emboss_tags, bevel_tags;
+  StageImage emboss = calculate_emboss_normal(*src, &emboss_tags);
+  StageImage bevel = calculate_bevel_normal(*src, &bevel_tags);
+  const FrameLayout &layout = src->layout;
+  const FrameLayout frames(s, h_frames, v_frames, false);
 
-  if (update_tileable)
+  auto stale = [&](const std::shared_ptr<CompactImage> &img) {
+    return !img || img->width() != s.width() || img->height() != s.height() ||
+           img->precision() != intermediate_precision();
+  };
+  bool full = rlist.count() == 0 || emboss != m_emboss_normal || bevel != m_distance_normal;
+  if (stale(m_height_in) || stale(m_height_ov))
   {
-    set_current_heightmap(0);
-    calculate_heightmap();
-    calculate_distance();
-    calculate_specular();
+    full = true;
+    m_height_in = std::make_shared<CompactImage>(s.width(), s.height(), 1);
+    const float bound = normal_bound(height_overlay_depth);
+    m_height_ov = std::make_shared<CompactImage>(s.width(), s.height(), 3, -bound, bound);
+    height_tags.clear();
   }
-
-  if (update_tileable)
+  if (composed_normal.front().size() != s)
   {
-    update_tileable = false;
-    distance_requested = true;
-  }
+    full = true;
+    normal_tags.clear();
+  }
+  m_emboss_normal = emboss;
+  m_distance_normal = bevel;
+
+  const TiledOverlay height_overlay = sprite.get_overlay(TextureTypes::HeightmapOverlay);
+  const TiledOverlay normal_overlay = sprite.get_overlay(TextureTypes::NormalOverlay);
+  const bool has_height = height_overlay.size() == s;
+
+  /* Height overlay weighted by its alpha, or 0 without one */
+  const int n = height_overlay.channels();
+  auto height_input = [&](const QRect &area) {
+    for_each_tile(area.left(), area.top(), area.right(), area.bottom(), [&](const Tile &t) {
+      float dst[tile_width];
+      uchar buffer[4 * tile_width];
+      for (int y = t.y0; y <= t.y1; y++)
+      {
+        const int count = t.x1 - t.x0 + 1;
+        const uchar *line = has_height ? height_overlay.span(t.x0, y, count, buffer) : nullptr;
+        for (int i = 0; i < count; i++)
+        {
+          dst[i] = line ? line[n * i] * (line[n * i + n - 1] / 255.0f) : 0.0f;
+        }
+        m_height_in->write(t.x0, y, 0, count, dst);
+      }
+    });
+  };
 
-  if (updateEnhance)
+  if (full)
   {
-    //for (int i = 0; i < rlist.count(); i++)
+    /* Frames whose inputs changed since they were last computed. Rect
+     * updates leave the tags behind, which only costs a recompute. */
+    rlist.clear();
+    QVector<quint64> new_height(layout.count()), new_normal(layout.count());
+    QVector<int> height_dirty;
+    for (int i = 0; i < layout.count(); i++)
     {
-      m_emboss_normal = calculate_normal(m_gray * 10.0, normal_depth, normal_blur_radius);
+      const quint64 height_ov = height_overlay.hash(layout.frame(i));
+      const quint64 normal_ov = normal_overlay.hash(layout.frame(i));
+      StageKey height_tag(static_cast<int>(Stage::HeightOverlayNormal));
+      height_tag << src->hashes.value(i) << height_ov;
+      new_height[i] = height_tag.value();
+      if (height_tags.size() != layout.count() || height_tags[i] != new_height[i])
+        height_dirty.append(i);
+
+      StageKey normal_tag(static_cast<int>(ProcessedImage::Normal));
+      normal_tag << emboss_tags.value(i) << bevel_tags.value(i) << new_height[i] << normal_ov
+                 << normalInvertX << normalInvertY << normalInvertZ;
+      new_normal[i] = normal_tag.value();
+      if (normal_tags.size() != layout.count() || normal_tags[i] != new_normal[i])
+        rlist.append(layout.frame(i));
     }
-  }
 
-  if (updateDistance)
-  {
-    new_distance = modify_distance();
-  }
+    parallel_for(height_dirty.size(), height_dirty.size() > 1, [&](int i) {
+      if (cancelled())
+        return;
 
-  if (updateBump)
+      QRect area = layout.frame(height_dirty[i]);
+      height_input(area);
+      calculate_normal(region_reader(*m_height_in), frames, *src, height_overlay_depth, 0,
+                       *m_height_ov, area);
+    });
+    height_tags = new_height;
+    normal_tags = new_normal;
+  }
+  else
   {
-    //for (int i = 0; i < rlist.count(); i++)
+    /* A brush on the height overlay only sends its rect */
+    foreach (QRect area, rlist)
     {
-      m_distance_normal = calculate_normal(new_distance, normal_bisel_depth * normal_bisel_distance, normal_bisel_blur_radius);
+      /* Plus the gradient's reach */
+      height_input(area.adjusted(-2, -2, 2, 2).intersected(sprite_rect));
+      calculate_normal(region_reader(*m_height_in), frames, *src, height_overlay_depth, 0,
+                       *m_height_ov, area);
     }
   }
 
+  const bool has_normal_ov = normal_overlay.size() == s;
 
-  if (m_normal.width() == 0 || m_normal.height() == 0)
-  {
-    m_normal = m_emboss_normal;
-  }
+  /* bits() once here, scanLine() is not safe to call from the workers */
+  QImage &normal = composed_normal.begin(s, QImage::Format_RGB888);
+  uchar *out_bits = normal.bits();
+  const int out_stride = normal.bytesPerLine();
 
-  foreach (QRect rect, rlist)
+  foreach (QRect area, rlist)
   {
-    int xmin = 0, xmax = texture.width() - 1;
-    int ymin = 0, ymax = texture.height() - 1;
-
-    if (rect != QRect(0, 0, 0, 0))
-    {
-      rect.getCoords(&xmin, &ymin, &xmax, &ymax);
-    }
-
-#pragma omp parallel for collapse(2)
-    for (int x = xmin; x <= xmax; ++x)
-    {
-      for (int y = ymin; y <= ymax; ++y)
+    for_each_tile(area.left(), area.top(), area.right(), area.bottom(), [&](const Tile &t) {
+      NormalComposeRow row;
+      row.invert[0] = normalInvertX;
+      row.invert[1] = normalInvertY;
+      row.invert[2] = normalInvertZ;
+      const int count = t.x1 - t.x0 + 1;
+      /* Compact inputs are widened here, a row at a time */
+      float buffers[9][tile_width];
+      uchar ov_buffer[4 * tile_width];
+      for (int y = t.y0; y <= t.y1; ++y)
       {
-        float nr, ng, nb, norm, r, g, b, a;
-        QColor ov = normalOverlay.pixelColor(x, y);
-        r = ov.redF() * 2 - 1;
-        g = ov.greenF() * 2 - 1;
-        b = ov.blueF() * 2 - 1;
-        a = ov.alphaF();
-        nr = m_emboss_normal(x, y, 0, 0) * 3 / 2.0 + m_distance_normal(x, y, 0, 0) * 3 / 2.0 + m_height_ov(x, y, 0, 0);
-        ng = m_emboss_normal(x, y, 0, 1) * 3 / 2.0 + m_distance_normal(x, y, 0, 1) * 3 / 2.0 + m_height_ov(x, y, 0, 1);
-        nb = m_emboss_normal(x, y, 0, 2) * 3 / 2.0 + m_distance_normal(x, y, 0, 2) * 3 / 2.0 + m_height_ov(x, y, 0, 2);
-
-        nr = nr * (1 - a) + (r)*a;
-        ng = ng * (1 - a) + (g)*a;
-        nb = nb * (1 - a) + (b)*a;
-        norm = sqrtf(nr * nr + ng * ng + nb * nb);
-
-        m_normal(x, y, 0, 0) = 255.0 * (nr / norm * 0.5 + 0.5);
-        m_normal(x, y, 0, 1) = 255.0 * (ng / norm * 0.5 + 0.5);
-        m_normal(x, y, 0, 2) = 255.0 * (nb / norm * 0.5 + 0.5);
-
+        for (int c = 0; c < 3; c++)
+        {
+          row.emboss[c] = m_emboss_normal->span(t.x0, y, c, count, buffers[c]);
+          row.bevel[c] = m_distance_normal->span(t.x0, y, c, count, buffers[3 + c]);
+          row.height[c] = m_height_ov->span(t.x0, y, c, count, buffers[6 + c]);
+        }
+        /* Unpainted overlay tiles are not blended */
+        row.overlay = has_normal_ov ? normal_overlay.span(t.x0, y, count, ov_buffer) : nullptr;
+        row.out = out_bits + y * out_stride + 3 * t.x0;
+        compose_normal_span(row, count);
       }
-    }
+    });
+  }
+
+  if (cancelled())
+  {
+    /* Superseded: whatever was skipped is redone by the next full run */
+    height_tags.clear();
+    normal_tags.clear();
+    m_emboss_normal.reset();
+    composed_normal.abandon(rlist.toVector());
+    normal_mutex.unlock();
+    return;
   }
 
   normal_ready.lock();
-  sprite.set_image(TextureTypes::Normal, CImg2QImage(m_normal));
+  sprite.set_image(TextureTypes::Normal, composed_normal.finish(rlist.toVector()));
   normal_ready.unlock();
 
   processed();
@@ -908,117 +1876,192 @@ void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bo
 
 }
 
-CImg<float> ImageProcessor::calculate_normal(CImg<float> in, int depth, int blur_radius, QRect r)
+/* Gradient normals of img inside area (img coordinates). alpha and out are
+ * indexed with img coordinates shifted by (ax, ay) and (ox, oy). */
+static void normals_from_height(const CImg<float> &img, const CImg<uchar> &alpha, int ax, int ay,
+                                const QRect &area, float kx, float ky,
+                                CompactImage &out, int ox, int oy)
 {
-  QSize s = sprite.size();
-
-  CImg<float> img(in);
+  const int w = img.width();
+  const int h = img.height();
+  const NormalKernels &kernels = normal_kernels();
 
-  if (img.width() == s.width() * 3)
+  CImg<uchar> opaque;
+  if (alpha.width() < w + ax || alpha.height() < h + ay)
   {
-    img.blur(blur_radius / 3.0, true, true);
+    opaque.assign(w, 1, 1, 1, 255);
   }
-  else
-  {
-    //    img.resize(-300,-300,-100,-100,0,2);
-    img.blur(blur_radius / 3.0);
-    //    img.crop(s.width(),s.height(),2*s.width()-1, 2*s.height()-1);
-  }
-  int xs, xe, ys, ye;
-  if (r == QRect(0, 0, 0, 0))
-  {
-    xs = 0;
-    xe = img.width() - 1;
-    ys = 0;
-    ye = img.height() - 1;
-  }
-  else
+
+  if (w < 3 || h < 3)
   {
-    xs = r.left();
-    xe = r.right();
-    ys = r.top();
-    ye = r.bottom();
+    std::vector<float> flat[3];
+    flat[0].assign(area.width(), 0.0f);
+    flat[1].assign(area.width(), 0.0f);
+    flat[2].assign(area.width(), 1.0f);
+    for (int y = area.top(); y <= area.bottom(); y++)
+    {
+      for (int c = 0; c < 3; c++)
+        out.write(area.left() + ox, y + oy, c, area.width(), flat[c].data());
+    }
+    return;
   }
 
-  CImg<float> normals(img.width(), img.height(), 1, 3);
+  for_each_tile(area.left(), area.top(), area.right(), area.bottom(), [&](const Tile &t) {
+    /* Normals of the tile row, indexed from t.x0, then stored in out */
+    float n[3][tile_width];
+    float *nx = n[0], *ny = n[1], *nz = n[2];
+    for (int y = t.y0; y <= t.y1; y++)
+    {
+      const float *row = img.data(0, y);
+      const uchar *a = opaque.is_empty() ? alpha.data(0, y + ay) + ax : opaque.data();
 
-  CImg<float> out(s.width(), s.height(), 1, 3);
+      /* Central differences, one sided second order ones at the borders */
+      const float *gy_rows[3];
+      float gy_coef[3];
+      if (y == 0)
+      {
+        gy_rows[0] = img.data(0, 0), gy_rows[1] = img.data(0, 1), gy_rows[2] = img.data(0, 2);
+        gy_coef[0] = -3, gy_coef[1] = 4, gy_coef[2] = -1;
+      }
+      else if (y == h - 1)
+      {
+        gy_rows[0] = img.data(0, y), gy_rows[1] = img.data(0, y - 1), gy_rows[2] = img.data(0, y - 2);
+        gy_coef[0] = 3, gy_coef[1] = -4, gy_coef[2] = 1;
+      }
+      else
+      {
+        gy_rows[0] = img.data(0, y - 1), gy_rows[1] = img.data(0, y), gy_rows[2] = img.data(0, y + 1);
+        gy_coef[0] = -1, gy_coef[1] = 0, gy_coef[2] = 1;
+      }
 
-  img /= 255.0;
+      auto border = [&](int x, float dx) {
+        float dy = gy_coef[0] * gy_rows[0][x] + gy_coef[1] * gy_rows[1][x] + gy_coef[2] * gy_rows[2][x];
+        nx[x - t.x0] = a[x] ? -dx * kx : 0.0f;
+        ny[x - t.x0] = a[x] ? dy * ky : 0.0f;
+        nz[x - t.x0] = 1.0f;
+      };
 
-int w = img.width();
-int h = img.height();
+      if (t.x0 == 0)
+      {
+        border(0, -3 * row[0] + 4 * row[1] - row[2]);
+      }
+      if (t.x1 == w - 1)
+      {
+        border(w - 1, 3 * row[w - 1] - 4 * row[w - 2] + row[w - 3]);
+      }
 
-float dx, dy;
-#pragma omp parallel for collapse(2) private(dx, dy)
-      for (int x = xs; x <= xe; x++)
+      int x0 = std::max(t.x0, 1), x1 = std::min(t.x1, w - 2);
+      if (x1 >= x0)
       {
-        for (int y = ys; y <= ye; y++)
-        {
+        const float *span_rows[3] = {gy_rows[0] + x0, gy_rows[1] + x0, gy_rows[2] + x0};
+        kernels.normal_span(row + x0, span_rows, gy_coef, a + x0, x1 - x0 + 1, kx, ky,
+                            nx + x0 - t.x0, ny + x0 - t.x0, nz + x0 - t.x0);
+      }
 
-          if (current_heightmap(x, y, 0, 3) == 0.0)
-          {
-            normals(x, y, 0, 0) = 0;
-            normals(x, y, 0, 1) = 0;
-            normals(x, y, 0, 2) = 1;
-            continue;
-          }
+      for (int c = 0; c < 3; c++)
+        out.write(t.x0 + ox, y + oy, c, t.x1 - t.x0 + 1, n[c]);
+    }
+  });
+}
 
-          if (x == 0)
-          {
-            dx = -3 * img(x, y) + 4 * img(x + 1, y) - img(x + 2, y);
-          }
-          else if (x == w - 1)
-          {
-            dx = 3 * img(x, y) - 4 * img(x - 1, y) + img(x - 2, y);
-          }
-          else
-          {
-            dx = -img(x - 1, y) + img(x + 1, y);
-          }
+/* Normals of the sprite area r of in, written to out, which is sprite sized
+ * with 3 channels. in is in source coordinates of in_layout, see
+ * FrameLayout; the alpha comes from src either way. Every frame is computed
+ * from its own source, and the frames and tiles of r run in parallel. */
+void ImageProcessor::calculate_normal(const RegionReader &in, const FrameLayout &in_layout,
+                                      const HeightmapSource &src, int depth, int blur_radius,
+                                      CompactImage &out, QRect r)
+{
+  const QSize s = sprite.size();
+  const QRect sprite_rect(0, 0, s.width(), s.height());
 
-          if (y == 0)
-          {
-            dy = -3 * img(x, y) + 4 * img(x, y + 1) - img(x, y + 2);
-          }
-          else if (y == h - 1)
-          {
-            dy = 3 * img(x, y) - 4 * img(x, y - 1) + img(x, y - 2);
-          }
-          else
-          {
-            dy = -img(x, y - 1) + img(x, y + 1);
-          }
+  r = r == QRect(0, 0, 0, 0) ? sprite_rect : r.intersected(sprite_rect);
+  if (r.isEmpty())
+    return;
 
-          normals(x, y, 0, 0) = -dx * (depth / 100.0) * normalInvertX;
-          normals(x, y, 0, 1) = dy * (depth / 100.0) * normalInvertY;
-          normals(x, y, 0, 2) = 1.0;
-        }
-      }
-  //  normals *= 255.0;
-  if (tileable)
+  /* Alpha of a crop of in around frame i */
+  const bool has_alpha = src.planes.width() == s.width() && src.planes.height() == s.height();
+  const bool canvas = in_layout.canvas() && src.layout.canvas();
+  auto alpha = [&](int i, const QRect &crop) {
+    if (!has_alpha)
+      return CImg<uchar>();
+    if (canvas)
+      return src.crop(src.planes, 3, crop.translated(in_layout.offset_to(src.layout, i)));
+    return src.planes.channel_view(3).get_crop(crop.left(), crop.top(), crop.right(), crop.bottom());
+  };
+
+  /* in is in [0, 255], fold the normalization into the depth. Inversion is
+   * applied when composing, so toggling it is cheap. */
+  const float k = depth / 100.0f / 255.0f;
+
+  /* Area of in to compute, where it goes in out, and the source of its
+   * frame: nothing outside of it is read */
+  struct Job
+  {
+    int frame;
+    QRect area;
+    QPoint offset;
+    QRect bounds;
+  };
+  QList<Job> jobs;
+  foreach (int i, in_layout.frames_in(r))
   {
-    int w = s.width() / h_frames;
-    int h = s.height() / v_frames;
+    QPoint d = in_layout.source_offset(i);
+    QRect bounds = in_layout.source(i);
+    QRect area = r.intersected(in_layout.frame(i));
+    if (has_alpha)
+    {
+      /* Transparent pixels get flat normals whatever their height, only
+       * the opaque cells are worked out. The area is the frame itself on
+       * a canvas too, so the map applies. */
+      const QRect opaque = src.occupancy.opaque_bounds(area);
+      const float flat[3] = {0.0f, 0.0f, 1.0f};
+      for (int c = 0; c < 3; c++)
+        fill_outside(out, area, opaque, c, flat[c]);
+      if (opaque.isEmpty())
+        continue;
+      area = opaque;
+    }
+    jobs.append({i, area.translated(d), -d, bounds});
+  }
 
-    int i, j;
-#pragma omp parallel for collapse(2)
-    for (i = 0; i < h_frames; i++)
+  /* Under a memory budget big areas go through in tiles, so the crops
+   * below stay small */
+  if (tiled_processing())
+  {
+    QList<Job> tiles;
+    const int side = budget_tile_side;
+    foreach (Job job, jobs)
     {
-      for (j = 0; j < v_frames; j++)
+      for (int y = job.area.top(); y <= job.area.bottom(); y += side)
       {
-        int si = i * 3 + 1;
-        int sj = j * 3 + 1;
-        CImg<float> frame_normal = normals.get_crop(si * w, sj * h, (si + 1) * w - 1, (sj + 1) * h - 1);
-        out.draw_image(i * w, j * h, frame_normal);
+        for (int x = job.area.left(); x <= job.area.right(); x += side)
+        {
+          tiles.append({job.frame, QRect(x, y, side, side).intersected(job.area), job.offset,
+                        job.bounds});
+        }
       }
     }
+    jobs = tiles;
   }
-  else
-  {
-    out = normals;
-  }
-  return out;
+
+  /* Blur reach plus the 1px of the gradient */
+  const int halo = gaussian_reach(blur_radius / 3.0f) + 1;
+
+  parallel_for(jobs.size(), jobs.size() > 1, [&](int i) {
+    if (cancelled())
+      return;
+
+    const Job &job = jobs.at(i);
+    QRect crop = job.area.adjusted(-halo, -halo, halo, halo).intersected(job.bounds);
+    CImg<float> img = in(crop);
+
+    gaussian_blur(img, blur_radius / 3.0f);
+
+    normals_from_height(img, alpha(job.frame, crop), 0, 0,
+                        job.area.translated(-crop.left(), -crop.top()), k, k,
+                        out, crop.left() + job.offset.x(), crop.top() + job.offset.y());
+  });
 }
 
 void ImageProcessor::copy_settings(ProcessorSettings s) { settings = s; }
@@ -1050,12 +2093,10 @@ int ImageProcessor::get_normal_invert_y() { return normalInvertY; }
 QImage *ImageProcessor::get_texture()
 {
   sprite.get_image(TextureTypes::Diffuse, &texture);
-  QImage ov(texture.size(), QImage::Format_RGBA8888_Premultiplied);
-  sprite.get_image(TextureTypes::TextureOverlay, &ov);
   last_texture.fill(Qt::transparent);
   QPainter p(&last_texture);
   p.drawImage(last_texture.rect(), texture);
-  p.drawImage(last_texture.rect(), ov);
+  sprite.get_overlay(TextureTypes::TextureOverlay).paint(&p);
   sprite.set_image(TextureTypes::Color, last_texture);
   return &last_texture;
 }
@@ -1100,74 +2141,87 @@ QImage *ImageProcessor::get_occlusion()
   return &last_occlussion;
 }
 
+/* Overlays are stored sparse, see TiledOverlay. The getters assemble a
+ * full image for the brushes to paint on, the setters keep only the
+ * painted tiles of it. */
+
 QImage ImageProcessor::get_texture_overlay()
 {
-  sprite.get_image(TextureTypes::TextureOverlay, &textureOverlay);
-  return textureOverlay;
+  QImage overlay;
+  sprite.get_image(TextureTypes::TextureOverlay, &overlay);
+  return overlay;
 }
 
-void ImageProcessor::set_texture_overlay(QImage to)
+void ImageProcessor::set_texture_overlay(QImage to, QRect rect)
 {
   sprite.set_image(TextureTypes::TextureOverlay, to);
+  /* No map reads it, calculate_texture() paints it over the diffuse */
+  Q_UNUSED(rect);
 }
 
 QImage ImageProcessor::get_normal_overlay()
 {
-  sprite.get_image(TextureTypes::NormalOverlay, &normalOverlay);
-  return normalOverlay;
+  QImage overlay;
+  sprite.get_image(TextureTypes::NormalOverlay, &overlay);
+  return overlay;
 }
 
-void ImageProcessor::set_normal_overlay(QImage no)
+void ImageProcessor::set_normal_overlay(QImage no, QRect rect)
 {
   sprite.set_image(TextureTypes::NormalOverlay, no);
-  normal_mutex.lock();
-  get_normal_overlay();
-  normal_mutex.unlock();
+  schedule(ProcessedImage::Normal, rect);
 }
 
 QImage ImageProcessor::get_parallax_overlay()
 {
-  sprite.get_image(TextureTypes::ParallaxOverlay, &parallaxOverlay);
-  return parallaxOverlay;
+  QImage overlay;
+  sprite.get_image(TextureTypes::ParallaxOverlay, &overlay);
+  return overlay;
 }
 
-void ImageProcessor::set_parallax_overlay(QImage po)
+void ImageProcessor::set_parallax_overlay(QImage po, QRect rect)
 {
   sprite.set_image(TextureTypes::ParallaxOverlay, po);
+  schedule(ProcessedImage::Parallax, rect);
 }
 
 QImage ImageProcessor::get_specular_overlay()
 {
-  sprite.get_image(TextureTypes::SpecularOverlay, &specularOverlay);
-  return specularOverlay;
+  QImage overlay;
+  sprite.get_image(TextureTypes::SpecularOverlay, &overlay);
+  return overlay;
 }
 
-void ImageProcessor::set_specular_overlay(QImage so)
+void ImageProcessor::set_specular_overlay(QImage so, QRect rect)
 {
   sprite.set_image(TextureTypes::SpecularOverlay, so);
+  schedule(ProcessedImage::Specular, rect);
 }
 
 QImage ImageProcessor::get_heightmap_overlay()
 {
-  sprite.get_image(TextureTypes::HeightmapOverlay, &heightOverlay);
-  return heightOverlay;
+  QImage overlay;
+  sprite.get_image(TextureTypes::HeightmapOverlay, &overlay);
+  return overlay;
 }
 
-void ImageProcessor::set_heightmap_overlay(QImage ho)
+void ImageProcessor::set_heightmap_overlay(QImage ho, QRect rect)
 {
   sprite.set_image(TextureTypes::HeightmapOverlay, ho);
+  schedule(ProcessedImage::Normal, rect);
 }
 
 QImage ImageProcessor::get_occlusion_overlay()
 {
-  sprite.get_image(TextureTypes::OcclussionOverlay,
-                   &occlussionOverlay);
-  return occlussionOverlay;
+  QImage overlay;
+  sprite.get_image(TextureTypes::OcclussionOverlay, &overlay);
+  return overlay;
 }
 
-void ImageProcessor::set_occlussion_overlay(QImage oo)
+void ImageProcessor::set_occlussion_overlay(QImage oo, QRect rect)
 {
   sprite.set_image(TextureTypes::OcclussionOverlay, oo);
+  schedule(ProcessedImage::Occlusion, rect);
 }
 
 bool ImageProcessor::get_parallax_invert() { return parallax_invert; }
@@ -1175,13 +2229,13 @@ bool ImageProcessor::get_parallax_invert() { return parallax_invert; }
 void ImageProcessor::set_parallax_invert(bool invert)
 {
   parallax_invert = invert;
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 void ImageProcessor::set_parallax_focus(int focus)
 {
   parallax_focus = focus;
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 int ImageProcessor::get_parallax_focus() { return parallax_focus; }
@@ -1189,7 +2243,7 @@ int ImageProcessor::get_parallax_focus() { return parallax_focus; }
 void ImageProcessor::set_parallax_soft(int soft)
 {
   parallax_soft = soft;
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 int ImageProcessor::get_parallax_soft() { return parallax_soft; }
@@ -1199,7 +2253,7 @@ int ImageProcessor::get_parallax_thresh() { return parallax_max; }
 void ImageProcessor::set_parallax_thresh(int thresh)
 {
   parallax_max = thresh;
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 int ImageProcessor::get_parallax_min() { return parallax_min; }
@@ -1208,7 +2262,7 @@ void ImageProcessor::set_parallax_min(int min)
 {
   parallax_min = min;
 
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 ParallaxType ImageProcessor::get_parallax_type() { return parallax_type; }
@@ -1217,7 +2271,7 @@ void ImageProcessor::set_parallax_type(ParallaxType ptype)
 {
   parallax_type = ptype;
 
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 int ImageProcessor::get_parallax_quantization()
@@ -1229,14 +2283,14 @@ void ImageProcessor::set_parallax_quantization(int q)
 {
   parallax_quantization = q;
 
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 void ImageProcessor::set_parallax_erode_dilate(int value)
 {
   parallax_erode_dilate = value;
 
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 int ImageProcessor::get_parallax_erode_dilate()
@@ -1248,7 +2302,7 @@ void ImageProcessor::set_parallax_contrast(int contrast)
 {
   parallax_contrast = contrast / 1000.0;
 
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 double ImageProcessor::get_parallax_contrast() { return parallax_contrast; }
@@ -1257,7 +2311,7 @@ void ImageProcessor::set_parallax_brightness(int brightness)
 {
   parallax_brightness = brightness;
 
-  parallax_counter = 1;
+  schedule(ProcessedImage::Parallax);
 }
 
 int ImageProcessor::get_parallax_brightness() { return parallax_brightness; }
@@ -1265,7 +2319,7 @@ int ImageProcessor::get_parallax_brightness() { return parallax_brightness; }
 void ImageProcessor::set_specular_blur(int blur)
 {
   specular_blur = blur;
-  specular_counter = 1;
+  schedule(ProcessedImage::Specular);
 }
 
 int ImageProcessor::get_specular_blur() { return specular_blur; }
@@ -1273,7 +2327,7 @@ int ImageProcessor::get_specular_blur() { return specular_blur; }
 void ImageProcessor::set_specular_bright(int bright)
 {
   specular_bright = bright;
-  specular_counter = 1;
+  schedule(ProcessedImage::Specular);
 }
 
 int ImageProcessor::get_specular_bright() { return specular_bright; }
@@ -1281,7 +2335,7 @@ int ImageProcessor::get_specular_bright() { return specular_bright; }
 void ImageProcessor::set_specular_invert(bool invert)
 {
   specular_invert = invert;
-  specular_counter = 1;
+  schedule(ProcessedImage::Specular);
 }
 
 bool ImageProcessor::get_specular_invert() { return specular_invert; }
@@ -1289,7 +2343,7 @@ bool ImageProcessor::get_specular_invert() { return specular_invert; }
 void ImageProcessor::set_specular_thresh(int thresh)
 {
   specular_thresh = thresh;
-  specular_counter = 1;
+  schedule(ProcessedImage::Specular);
 }
 
 int ImageProcessor::get_specular_trhesh() { return specular_thresh; }
@@ -1297,7 +2351,7 @@ int ImageProcessor::get_specular_trhesh() { return specular_thresh; }
 void ImageProcessor::set_specular_contrast(int contrast)
 {
   specular_contrast = contrast / 1000.0;
-  specular_counter = 1;
+  schedule(ProcessedImage::Specular);
 }
 
 double ImageProcessor::get_specular_contrast() { return specular_contrast; }
@@ -1305,7 +2359,7 @@ double ImageProcessor::get_specular_contrast() { return specular_contrast; }
 void ImageProcessor::set_occlusion_blur(int blur)
 {
   occlusion_blur = blur;
-  occlussion_counter = 1;
+  schedule(ProcessedImage::Occlusion);
 }
 
 int ImageProcessor::get_occlusion_blur() { return occlusion_blur; }
@@ -1313,7 +2367,7 @@ int ImageProcessor::get_occlusion_blur() { return occlusion_blur; }
 void ImageProcessor::set_occlusion_bright(int bright)
 {
   occlusion_bright = bright;
-  occlussion_counter = 1;
+  schedule(ProcessedImage::Occlusion);
 }
 
 int ImageProcessor::get_occlusion_bright() { return occlusion_bright; }
@@ -1321,7 +2375,7 @@ int ImageProcessor::get_occlusion_bright() { return occlusion_bright; }
 void ImageProcessor::set_occlusion_invert(bool invert)
 {
   occlusion_invert = invert;
-  occlussion_counter = 1;
+  schedule(ProcessedImage::Occlusion);
 }
 
 bool ImageProcessor::get_occlusion_invert() { return occlusion_invert; }
@@ -1329,7 +2383,7 @@ bool ImageProcessor::get_occlusion_invert() { return occlusion_invert; }
 void ImageProcessor::set_occlusion_thresh(int thresh)
 {
   occlusion_thresh = thresh;
-  occlussion_counter = 1;
+  schedule(ProcessedImage::Occlusion);
 }
 
 int ImageProcessor::get_occlusion_trhesh() { return occlusion_thresh; }
@@ -1337,7 +2391,7 @@ int ImageProcessor::get_occlusion_trhesh() { return occlusion_thresh; }
 void ImageProcessor::set_occlusion_contrast(int contrast)
 {
   occlusion_contrast = contrast / 1000.0;
-  occlussion_counter = 1;
+  schedule(ProcessedImage::Occlusion);
 }
 
 double ImageProcessor::get_occlusion_contrast() { return occlusion_contrast; }
@@ -1345,7 +2399,7 @@ double ImageProcessor::get_occlusion_contrast() { return occlusion_contrast; }
 void ImageProcessor::set_occlusion_distance_mode(bool distance_mode)
 {
   occlusion_distance_mode = distance_mode;
-  occlussion_counter = 1;
+  schedule(ProcessedImage::Occlusion);
 }
 
 bool ImageProcessor::get_occlusion_distance_mode()
@@ -1356,7 +2410,7 @@ bool ImageProcessor::get_occlusion_distance_mode()
 void ImageProcessor::set_occlusion_distance(int distance)
 {
   occlusion_distance = distance;
-  occlussion_counter = 1;
+  schedule(ProcessedImage::Occlusion);
 }
 
 int ImageProcessor::get_occlusion_distance() { return occlusion_distance; }
@@ -1443,7 +2497,12 @@ void ImageProcessor::set_offset(QVector3D new_off) { offset = new_off; }
 
 QVector3D *ImageProcessor::get_offset() { return &offset; }
 
-void ImageProcessor::set_selected(bool s) { selected = s; }
+void ImageProcessor::set_selected(bool s)
+{
+  selected = s;
+  if (s)
+    MemoryAccountant::instance().touch(this);
+}
 
 bool ImageProcessor::get_selected() { return selected; }
 
@@ -1579,7 +2638,7 @@ int ImageProcessor::WrapCoordinate(int coord, int interval)
   return coord;
 }
 
-QImage ImageProcessor::CImg2QImage(CImg<uchar> in)
+QImage ImageProcessor::CImg2QImage(const CImg<uchar> &in)
 {
   int w = in.width(), h = in.height(), channels = in.spectrum();
 
@@ -1596,79 +2655,46 @@ QImage ImageProcessor::CImg2QImage(CImg<uchar> in)
     case 4:
       format = QImage::Format_RGBA8888;
       break;
+    default:
+      return QImage();
   }
 
   QImage out(w, h, format);
-
-  for (int y = 0; y < h; y++)
-  {
-    unsigned char *dst = out.scanLine(y);
-    for (int x = 0; x < w; x++)
-    {
-      for (int c = 0; c < channels; c++)
-      {
-        *dst = in(x, y, 0, c);
-        dst++;
-      }
-    }
-  }
-  //  in.permute_axes("cxyz");
-  //  return QImage(in.data(), in.height(), in.depth(), format);
-
+  interleave_pixels(in.data(), w, h, channels, out.bits(), out.bytesPerLine());
   return out;
 }
 
-CImg<uchar> ImageProcessor::QImage2CImg(QImage in)
+QImage ImageProcessor::CImg2QImage(const CImg<float> &in)
 {
-  int channels;
-  switch (in.format())
+  int w = in.width(), h = in.height(), channels = in.spectrum();
+
+  QImage::Format format;
+
+  switch (channels)
   {
-    case QImage::Format_RGBA8888:
-    case QImage::Format_RGBA8888_Premultiplied:
-      channels = 4;
-      break;
-    case QImage::Format_RGB888:
-      channels = 3;
-      break;
-    case QImage::Format_Grayscale8:
-      channels = 1;
-      break;
-    case QImage::Format_RGB32:
-      channels = 3;
-      in = in.convertToFormat(QImage::Format_RGB888);
+    case 1:
+      format = QImage::Format_Grayscale8;
       break;
-    case QImage::Format_ARGB32:
-      channels = 4;
-      in.convertTo(QImage::Format_RGBA8888);
+    case 3:
+      format = QImage::Format_RGB888;
       break;
-    case QImage::Format_ARGB32_Premultiplied:
-      channels = 4;
-      in.convertTo(QImage::Format_RGBA8888_Premultiplied);
+    case 4:
+      format = QImage::Format_RGBA8888;
       break;
     default:
-      channels = 0;
+      return QImage();
   }
 
-  int w = in.width(), h = in.height();
-
-  //  CImg<uchar> srt(in.bits(), channels, w, h, 1);
-  //  srt.permute_axes("yzcx");
-
-  CImg<uchar> srt(w, h, 1, channels);
+  /* Saturate straight from the float planes, no intermediate CImg<uchar> */
+  QImage out(w, h, format);
+  interleave_pixels(in.data(), w, h, channels, out.bits(), out.bytesPerLine());
+  return out;
+}
 
-  cimg_forY(srt, y)
-  {
-    unsigned char *src = in.scanLine(y);
-    cimg_forX(srt, x)
-    {
-      for (int c = 0; c < channels; c++)
-      {
-        srt(x, y, 0, c) = *src;
-        src++;
-      }
-    }
-  }
-  return srt;
+CImg<uchar> ImageProcessor::QImage2CImg(QImage in)
+{
+  /* Owning copy, callers are free to modify it */
+  return CImg<uchar>(PlanarImage::from_qimage(in).view(), false);
 }
 
 bool ImageProcessor::get_use_normal_alpha()
@@ -1902,6 +2928,11 @@ void ImageProcessor::splitInFrames(int h_frames, int v_frames)
   setHFrames(h_frames);
   setVFrames(v_frames);
   reset_neighbours();
+  /* Maps are processed per frame, a new framing changes all of them */
+  schedule(ProcessedImage::Normal);
+  schedule(ProcessedImage::Specular);
+  schedule(ProcessedImage::Parallax);
+  schedule(ProcessedImage::Occlusion);
 }
 
 QString ImageProcessor::getFrameMode()
@@ -20,11 +20,18 @@
 #ifndef IMAGEPROCESSOR_H
 #define IMAGEPROCESSOR_H
 
+#include "src/frame_layout.h"
 #include "src/light_source.h"
+#include "src/memory_accountant.h"
+#include "src/neighbour_canvas.h"
+#include "src/occupancy.h"
+#include "src/planar_image.h"
 #include "src/sprite.h"
+#include "src/stage_cache.h"
 
 #include <QBrush>
 #include <QFuture>
+#include <QHash>
 #include <QImage>
 #include <QList>
 #include <QMutex>
@@ -35,6 +42,8 @@
 #include <QTimer>
 #include <QVector2D>
 
+#include <functional>
+
 #define cimg_display 0
 #include "thirdparty/CImg.h"
 
@@ -47,6 +56,64 @@ enum class ProcessedImage
   Occlusion
 };
 
+/* Nodes of the processing graph:
+ *
+ *   heightmap -> distance -> bevel -> bevel normal ---> normal
+ *       |            |                                   ^
+ *       +------------+-----------------> emboss normal --+
+ *       +--> parallax (also reads bevel)
+ *       +--> occlusion
+ *   specular base -> specular
+ *
+ * Gray and alpha planes of the heightmap are cached by its Texture, the
+ * other nodes by a StageCache, keyed on their inputs and parameters. Height
+ * overlay normals follow the brush, so they are updated in place instead.
+ *
+ * Every node works frame by frame, see FrameLayout. Each frame carries a tag
+ * of its parameters and source pixels, so a new output reuses the frames of
+ * the previous one whose tag didn't change, and composing a map only
+ * touches the frames whose tags or overlay changed. */
+enum class Stage
+{
+  Heightmap,
+  Distance,
+  Bevel,
+  EmbossNormal,
+  BevelNormal,
+  HeightOverlayNormal,
+  Specular,
+  Parallax,
+  Occlusion
+};
+
+/* Heightmap inputs of the stages, taken once per source version. It is
+ * never modified after it is built, so the normal, parallax and occlusion
+ * branches all read the same one at the same time without a lock. */
+struct HeightmapSource
+{
+  /* Key of the source texture and framing the planes come from */
+  quint64 key = 0;
+  /* Sprite sized planes of the heightmap */
+  PlanarImage planes;
+  PlanarImage gray_planes;
+  /* Transparent and flat cells of the planes, in sprite coordinates */
+  Occupancy occupancy;
+  /* Where tileable stages find the neighbours of the frames */
+  NeighbourCanvas neighbours;
+  /* Frames of the source, with whole neighbour cells when tileable, and
+   * their content hashes */
+  FrameLayout layout;
+  QVector<quint64> hashes;
+
+  /* Region r of channel c of planes or gray_planes, in source
+   * coordinates: through the neighbours canvas when tileable */
+  cimg_library::CImg<uchar> crop(const PlanarImage &p, int c, const QRect &r) const;
+};
+typedef std::shared_ptr<const HeightmapSource> HeightmapSnapshot;
+
+/* Reads a region of a stage input, in the input's own coordinates */
+typedef std::function<cimg_library::CImg<float>(const QRect &)> RegionReader;
+
 enum class ParallaxType
 {
   Binary,
@@ -139,19 +206,12 @@ class ImageProcessor : public QObject
   Q_OBJECT
 
 public:
-  QImage heightOverlay = QImage(0, 0, QImage::Format_RGBA8888);
-  QImage heightmap;
   QImage last_normal;
-  QImage normalOverlay = QImage(0, 0, QImage::Format_RGBA8888);
   QImage occlussion, last_occlussion;
-  QImage occlussionOverlay = QImage(0, 0, QImage::Format_RGBA8888);
   QImage parallax, last_parallax;
-  QImage parallaxOverlay = QImage(0, 0, QImage::Format_RGBA8888);
   QImage specular, last_specular;
-  QImage specularOverlay = QImage(0, 0, QImage::Format_RGBA8888);
   QImage specular_base;
   QImage texture, last_texture;
-  QImage textureOverlay = QImage(0, 0, QImage::Format_RGBA8888);
   QMutex heightmap_overlay_mutex;
   QMutex normal_overlay_mutex;
   QMutex occlussion_overlay_mutex;
@@ -159,19 +219,18 @@ public:
   QMutex specular_overlay_mutex;
   QMutex texture_overlay_mutex;
   QString m_fileName, m_absolute_path;
-  QTimer animation, recalculate_timer;
+  QTimer animation;
   Sprite sprite;
   QString frame_mode = "Sheet";
   bool busy;
   bool updated = false;
 
-  int normal_counter, parallax_counter, specular_counter, occlussion_counter;
-
   // These will only be used in the cli interface for now, to avoid calculating maps that wont be exported.
 
   bool has_normal = true, has_parallax = true, has_specular = true, has_occlusion = true;
 
-  QRect rect_requested = QRect(0, 0, 0, 0);
+  // Show downscaled maps first while parameters change on big sprites.
+  bool progressive_preview = true;
 
   QVector<QVector<float>> vertices;
 
@@ -201,7 +260,7 @@ private:
   QVector3D position;
   int selected_frame = 0;
   bool customHeightMap, customSpecularMap;
-  bool normal_bisel_soft, tileable, update_tileable = false, parallax_invert;
+  bool normal_bisel_soft, tileable, parallax_invert;
   bool occlusion_distance_mode;
   bool occlusion_invert;
   bool selected, tileX, tileY, is_parallax, connected;
@@ -211,17 +270,77 @@ private:
   bool useParallaxAlpha = false;
   bool useSpecularAlpha = false;
   bool useOcclusionAlpha = false;
-  cimg_library::CImg<float> current_heightmap;
-  cimg_library::CImg<float> current_occlusion;
-  cimg_library::CImg<float> current_parallax;
-  cimg_library::CImg<float> current_specular;
-  cimg_library::CImg<float> m_distance;
-  cimg_library::CImg<float> new_distance;
-  cimg_library::CImg<float> m_distance_normal;
-  cimg_library::CImg<float> m_emboss_normal;
-  cimg_library::CImg<float> m_normal;
-  cimg_library::CImg<float> m_gray;
-  cimg_library::CImg<float> m_height_ov, aux_height_ov;
+  /* Latest heightmap snapshot, guarded by heightmap_mutex */
+  HeightmapSnapshot m_heightmap;
+  /* Neighbours of the frames in tileable mode, see neighbour_canvas() */
+  QMutex neighbours_mutex;
+  NeighbourCanvas neighbours;
+  StageCache stage_cache;
+  StageImage m_distance_normal;
+  StageImage m_emboss_normal;
+  std::shared_ptr<CompactImage> m_height_ov, m_height_in;
+
+  /* Last output of a frame stage, per node */
+  struct FrameRun
+  {
+    quint64 params = 0;
+    QVector<quint64> hashes;
+    StageImage image;
+  };
+  /* Composed map and the frame tags it was composed from. It is composed
+   * into two buffers in turn: the published one is never written again, so
+   * writing doesn't detach it, and the other one first catches up with it by
+   * copying what the last run changed. */
+  struct ComposedMap
+  {
+    QImage buffers[2];
+    int published = 0;
+    /* Areas where the back buffer lags the published one */
+    QVector<QRect> lag;
+    QVector<quint64> tags;
+
+    const QImage &front() const { return buffers[published]; }
+    /* The back buffer, of size and format, equal to the published one
+     * unless the published one has another size */
+    QImage &begin(QSize size, QImage::Format format);
+    /* Publishes the back buffer, dirty being the areas composed into it */
+    const QImage &finish(const QVector<QRect> &dirty);
+    /* Drops a cancelled run that wrote dirty into the back buffer */
+    void abandon(const QVector<QRect> &dirty);
+    qint64 back_bytes() const;
+    void release_back();
+  };
+  QMutex frame_mutex;
+  QHash<int, FrameRun> frame_runs;
+  QHash<quint64, QVector<quint64>> hash_cache;
+  ComposedMap composed_normal, composed_parallax, composed_specular, composed_occlusion;
+  QVector<quint64> height_tags, normal_tags;
+  /* Depth the height overlay normals are computed with */
+  int height_overlay_depth = 5000;
+
+  /* Downscaled copies of this processor, for progressive previews */
+  struct PreviewLevel
+  {
+    int factor = 0;
+    std::unique_ptr<ImageProcessor> processor;
+    /* Source textures the copy was scaled from */
+    QHash<int, quint64> keys;
+    /* Held for a whole preview run: the maps share the copy's parameters */
+    QMutex run_mutex;
+  };
+  QMutex preview_mutex;
+  PreviewLevel previews[2];
+  void create_previews();
+  ImageProcessor *prepare_preview(PreviewLevel &level);
+  /* Processor left out of the MemoryAccountant, for preview levels */
+  ImageProcessor(QObject *parent, bool accounted);
+
+  /* Buffers as last measured, guarded by the MemoryAccountant */
+  QList<BufferUsage> last_usage;
+  QList<BufferUsage> measure();
+  /* Takes the mutexes of all the maps, when no map is being computed */
+  bool try_lock_maps();
+  void unlock_maps();
 
   double occlusion_contrast;
   double parallax_contrast;
@@ -230,7 +349,6 @@ private:
   float sx, sy;
   float zoom;
   int current_frame_id = 0;
-  bool enhance_requested = false, bump_requested = false, distance_requested = false;
   int normalInvertX, normalInvertY, normalInvertZ;
   int normal_bisel_blur_radius;
   int normal_bisel_depth;
@@ -252,12 +370,11 @@ private:
   int specular_bright;
   int specular_thresh;
 
-  int current_heightmap_id = -1;
-
   int h_frames = 1, v_frames = 1;
 
 public:
   explicit ImageProcessor(QObject *parent = nullptr);
+  ~ImageProcessor();
   QImage *get_normal();
   QImage *get_occlusion();
   QImage *get_parallax();
@@ -267,21 +384,37 @@ public:
   QString get_heightmap_path();
   QString get_name();
   QString get_specular_path();
-  cimg_library::CImg<float> modify_distance();
-  cimg_library::CImg<float> modify_occlusion();
-  cimg_library::CImg<float> modify_parallax();
-  cimg_library::CImg<float> modify_specular();
+  HeightmapSnapshot heightmap_source();
+  /* Bytes of every buffer, see MemoryAccountant. A processor that is
+   * computing reports what it held when it was last idle. */
+  QList<BufferUsage> memory_usage();
+  /* Drops the stage intermediates, the stages rebuild them when they run
+   * again. Returns the bytes released, nothing while computing. */
+  qint64 release_intermediates();
+  StageImage modify_distance(const HeightmapSource &src, const FrameLayout &layout);
+  StageImage modify_occlusion(const HeightmapSource &src, QVector<quint64> *tags = nullptr);
+  StageImage modify_parallax(const HeightmapSource &src, QVector<quint64> *tags = nullptr);
+  StageImage modify_specular(QVector<quint64> *tags = nullptr);
+  void parallax_steps(float *lut);
   int loadHeightMap(QString fileName, QImage height);
   int loadImage(QString fileName, QImage image, QString basePath = "");
   int loadSpecularMap(QString fileName, QImage specular);
-  void calculate_distance();
+  StageImage calculate_distance(const HeightmapSource &src, const FrameLayout &layout);
+  FrameLayout bevel_layout(const HeightmapSource &src);
+  StageImage calculate_emboss_normal(const HeightmapSource &src, QVector<quint64> *tags = nullptr);
+  StageImage calculate_bevel_normal(const HeightmapSource &src, QVector<quint64> *tags = nullptr);
   void calculate_gradient();
   void calculate_heightmap();
   void calculate_texture();
-  cimg_library::CImg<float> calculate_normal(cimg_library::CImg<float> in, int depth, int blur_radius, QRect r = QRect(0, 0, 0, 0));
+  void calculate_normal(const RegionReader &in, const FrameLayout &in_layout,
+                        const HeightmapSource &src, int depth, int blur_radius, CompactImage &out,
+                        QRect r = QRect(0, 0, 0, 0));
+  /* Computes rect of the normal map, all of it for QRect(0, 0, 0, 0) */
+  void generate_normal_map(QRect rect);
+  /* Deprecated, schedules the normal map: the flags are ignored */
+  Q_DECL_DEPRECATED_X("use schedule(ProcessedImage::Normal, rect)")
   void generate_normal_map(bool updateEnhance = true, bool updateBump = true,
-                           bool updateDistance = true,
-                           QRect rect = QRect(0, 0, 0, 0));
+                           bool updateDistance = true, QRect rect = QRect(0, 0, 0, 0));
   void set_name(QString name);
   QImage get_normal_overlay();
   QImage get_texture_overlay();
@@ -293,14 +426,32 @@ public:
   void calculate_occlusion();
   void calculate_parallax();
   void calculate_specular();
-  void set_heightmap_overlay(QImage ho);
-  void set_normal_overlay(QImage no);
-  void set_occlussion_overlay(QImage oo);
-  void set_parallax_overlay(QImage po);
-  void set_specular_overlay(QImage so);
-  void set_texture_overlay(QImage to);
+  void schedule(ProcessedImage map, QRect rect = QRect(0, 0, 0, 0));
+  /* Deprecated, schedules every map */
+  Q_DECL_DEPRECATED_X("use schedule() for the maps that changed")
+  void recalculate();
+  void publish_previews(ProcessedImage map);
+  /* Set an overlay and schedule the maps it feeds over rect, the area the
+   * brush painted, or all of them for QRect(0, 0, 0, 0) */
+  void set_heightmap_overlay(QImage ho, QRect rect = QRect(0, 0, 0, 0));
+  void set_normal_overlay(QImage no, QRect rect = QRect(0, 0, 0, 0));
+  void set_occlussion_overlay(QImage oo, QRect rect = QRect(0, 0, 0, 0));
+  void set_parallax_overlay(QImage po, QRect rect = QRect(0, 0, 0, 0));
+  void set_specular_overlay(QImage so, QRect rect = QRect(0, 0, 0, 0));
+  void set_texture_overlay(QImage to, QRect rect = QRect(0, 0, 0, 0));
   int WrapCoordinate(int coord, int interval);
-  QImage CImg2QImage(cimg_library::CImg<uchar> in);
+  QImage CImg2QImage(const cimg_library::CImg<uchar> &in);
+  QImage CImg2QImage(const cimg_library::CImg<float> &in);
+  NeighbourCanvas neighbour_canvas();
+  QVector<quint64> source_hashes(TextureTypes type, QImage::Format format, const FrameLayout &layout,
+                                 const NeighbourCanvas &canvas);
+  QVector<quint64> frame_hashes(TextureTypes type, QImage::Format format,
+                                const FrameLayout &layout, bool source);
+  StageImage update_frames(const StageKey &params, const QVector<quint64> &hashes,
+                           const FrameLayout &layout, bool source_space, int channels,
+                           float lo, float hi, const std::function<void(int, CompactImage &)> &fn);
+  QImage compose_gray_map(const CompactImage &map, const QVector<quint64> &tags,
+                          TextureTypes overlay, ComposedMap &last);
   cimg_library::CImg<uchar> QImage2CImg(QImage in);
 
   int get_frame_count();
@@ -329,11 +480,12 @@ public:
 
 public slots:
   void playAnimation(bool play);
-  void recalculate();
   void setAnimationRate(int fps);
   ParallaxType get_parallax_type();
   ProcessorSettings get_settings();
   QImage get_neighbour(int x, int y);
+  QImage get_neighbours_canvas();
+  void set_neighbours_canvas(QImage canvas);
   QList<LightSource *> *get_light_list_ptr();
   QVector3D *get_offset();
   QVector3D *get_position();
@@ -399,7 +551,6 @@ public slots:
   void reset_neighbours();
   void set_connected(bool c);
   void set_current_frame_id(int id);
-  void set_current_heightmap(int id);
   void set_is_parallax(bool p);
   void set_light_list(QList<LightSource *> &list);
   void set_normal_bisel_blur_radius(int radius);
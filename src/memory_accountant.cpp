@@ -0,0 +1,122 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "memory_accountant.h"
+#include "image_processor.h"
+#include "scratch_memory.h"
+
+MemoryAccountant &MemoryAccountant::instance()
+{
+  static MemoryAccountant accountant;
+  return accountant;
+}
+
+void MemoryAccountant::add(ImageProcessor *processor)
+{
+  QMutexLocker locker(&mutex);
+  if (!processors.contains(processor))
+    processors.prepend(processor);
+}
+
+/* Waits for a running enforce(), so processor can go right after */
+void MemoryAccountant::remove(ImageProcessor *processor)
+{
+  QMutexLocker locker(&mutex);
+  processors.removeAll(processor);
+}
+
+void MemoryAccountant::touch(ImageProcessor *processor)
+{
+  QMutexLocker locker(&mutex);
+  if (processors.removeAll(processor) > 0)
+    processors.prepend(processor);
+}
+
+/* Processors are only asked while they are listed, and they never wait for
+ * the accountant while they compute, so holding the mutex is safe */
+QList<QPair<ImageProcessor *, QList<BufferUsage>>> MemoryAccountant::report()
+{
+  QMutexLocker locker(&mutex);
+  QList<QPair<ImageProcessor *, QList<BufferUsage>>> usage;
+  for (ImageProcessor *p : processors)
+  {
+    usage.append(qMakePair(p, p->memory_usage()));
+  }
+  return usage;
+}
+
+QString MemoryAccountant::summary()
+{
+  const qint64 mib = 1048576;
+  qint64 total = 0, intermediate = 0;
+  QString text;
+  for (const auto &entry : report())
+  {
+    qint64 held = 0;
+    for (const BufferUsage &buffer : entry.second)
+    {
+      held += buffer.bytes;
+    }
+    if (held == 0)
+      continue;
+    text += QString("%1: %2 MiB\n").arg(entry.first->get_name()).arg(double(held) / mib, 0, 'f', 1);
+    for (const BufferUsage &buffer : entry.second)
+    {
+      if (buffer.bytes == 0)
+        continue;
+      text += QString("  %1%2: %3 MiB\n")
+                  .arg(buffer.name)
+                  .arg(buffer.intermediate ? " (intermediate)" : "")
+                  .arg(double(buffer.bytes) / mib, 0, 'f', 1);
+      if (buffer.intermediate)
+        intermediate += buffer.bytes;
+    }
+    total += held;
+  }
+  text += QString("total: %1 MiB, intermediates: %2 MiB, budget: %3 MiB\n")
+              .arg(double(total) / mib, 0, 'f', 1)
+              .arg(double(intermediate) / mib, 0, 'f', 1)
+              .arg(memory_budget() / mib);
+  return text;
+}
+
+void MemoryAccountant::enforce()
+{
+  const qint64 budget = memory_budget();
+  if (budget == 0)
+    return;
+
+  QMutexLocker locker(&mutex);
+  qint64 held = 0;
+  for (ImageProcessor *p : processors)
+  {
+    for (const BufferUsage &buffer : p->memory_usage())
+    {
+      if (buffer.intermediate)
+        held += buffer.bytes;
+    }
+  }
+
+  for (int i = processors.size() - 1; i >= 0 && held > budget; i--)
+  {
+    if (processors[i]->get_selected())
+      continue;
+    held -= processors[i]->release_intermediates();
+  }
+}
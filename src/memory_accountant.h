@@ -0,0 +1,74 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef MEMORYACCOUNTANT_H
+#define MEMORYACCOUNTANT_H
+
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QString>
+
+class ImageProcessor;
+
+/* Bytes one buffer of a processor holds */
+struct BufferUsage
+{
+  QString name;
+  qint64 bytes = 0;
+  /* Released by ImageProcessor::release_intermediates */
+  bool intermediate = false;
+};
+
+/* Keeps the memory of every processor and the order they were used in.
+ *
+ * With a memory budget (see scratch_memory.h), once the intermediates of
+ * all processors together go past it, the processors used least recently
+ * release theirs until they fit again. The stages rebuild them the next
+ * time the processor runs; its maps stay, so nothing is recomputed just to
+ * show it. The selected processors and the ones computing keep theirs.
+ *
+ * Textures are not released, they are the data. Textures that processors
+ * share are counted by each of them. */
+class MemoryAccountant
+{
+public:
+  static MemoryAccountant &instance();
+
+  void add(ImageProcessor *processor);
+  void remove(ImageProcessor *processor);
+  /* processor was just used, it goes last in the eviction order */
+  void touch(ImageProcessor *processor);
+
+  /* Buffers of every processor, most recently used first */
+  QList<QPair<ImageProcessor *, QList<BufferUsage>>> report();
+  /* report() as text, one line per buffer */
+  QString summary();
+  /* Releases intermediates while they are over the budget */
+  void enforce();
+
+private:
+  MemoryAccountant() {}
+
+  QMutex mutex;
+  /* Most recently used first */
+  QList<ImageProcessor *> processors;
+};
+
+#endif // MEMORYACCOUNTANT_H
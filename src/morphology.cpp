@@ -0,0 +1,168 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "morphology.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+using namespace cimg_library;
+
+static const int strip_lanes = 64;
+
+/* before(size) is how far windows reach behind their pixel. CImg centers
+ * even dilation windows one pixel later than erosion ones. */
+struct Max
+{
+  static float apply(float a, float b) { return a > b ? a : b; }
+  static float identity() { return -std::numeric_limits<float>::infinity(); }
+  static int before(int size) { return size / 2; }
+};
+
+struct Min
+{
+  static float apply(float a, float b) { return a < b ? a : b; }
+  static float identity() { return std::numeric_limits<float>::infinity(); }
+  static int before(int size) { return size - 1 - size / 2; }
+};
+
+/* Windows of size samples along x (horizontal) or y of a width x height
+ * plane. The window of sample i covers [i - before, i - before + size). */
+template <typename Op>
+static void morph_axis(float *plane, int width, int height, bool horizontal, int size, bool wrap)
+{
+  const int length = horizontal ? width : height;
+  const int count = horizontal ? height : width;
+  const int before = Op::before(size);
+  /* Extended line: before + length + after samples, in whole blocks */
+  const int n = (before + length + size - 1 + size - 1) / size * size;
+  const int strips = (count + strip_lanes - 1) / strip_lanes;
+
+  std::atomic<int> next(0);
+  parallel_team(strips, static_cast<long>(width) * height > 65536, [&]() {
+    std::vector<float> g(static_cast<size_t>(n) * strip_lanes), h(g.size());
+
+    for (int s = next++; s < strips; s = next++)
+    {
+      const int first = s * strip_lanes;
+      const int lanes = std::min(strip_lanes, count - first);
+
+      /* Gather the extended lines, g holds the samples for now */
+      for (int i = 0; i < n; i++)
+      {
+        int k = i - before;
+        float *dst = g.data() + static_cast<size_t>(i) * lanes;
+        if (wrap)
+        {
+          k = (k % length + length) % length;
+        }
+        else if (k < 0 || k >= length)
+        {
+          std::fill_n(dst, lanes, Op::identity());
+          continue;
+        }
+        if (horizontal)
+        {
+          for (int l = 0; l < lanes; l++)
+            dst[l] = plane[static_cast<size_t>(first + l) * width + k];
+        }
+        else
+        {
+          std::copy_n(plane + static_cast<size_t>(k) * width + first, lanes, dst);
+        }
+      }
+
+      /* Suffix extrema of each block, then prefix extrema in place */
+      for (int i = n - 1; i >= 0; i--)
+      {
+        float *hi = h.data() + static_cast<size_t>(i) * lanes;
+        const float *x = g.data() + static_cast<size_t>(i) * lanes;
+        if (i % size == size - 1)
+        {
+          std::copy_n(x, lanes, hi);
+        }
+        else
+        {
+          const float *next = hi + lanes;
+          for (int l = 0; l < lanes; l++)
+            hi[l] = Op::apply(x[l], next[l]);
+        }
+      }
+      for (int i = 0; i < n; i++)
+      {
+        if (i % size == 0)
+          continue;
+        float *gi = g.data() + static_cast<size_t>(i) * lanes;
+        const float *prev = gi - lanes;
+        for (int l = 0; l < lanes; l++)
+          gi[l] = Op::apply(gi[l], prev[l]);
+      }
+
+      /* The window starting at i spans the end of one block and the start
+       * of the next one */
+      for (int i = 0; i < length; i++)
+      {
+        const float *hi = h.data() + static_cast<size_t>(i) * lanes;
+        const float *gi = g.data() + static_cast<size_t>(i + size - 1) * lanes;
+        if (horizontal)
+        {
+          for (int l = 0; l < lanes; l++)
+            plane[static_cast<size_t>(first + l) * width + i] = Op::apply(hi[l], gi[l]);
+        }
+        else
+        {
+          float *dst = plane + static_cast<size_t>(i) * width + first;
+          for (int l = 0; l < lanes; l++)
+            dst[l] = Op::apply(hi[l], gi[l]);
+        }
+      }
+    }
+  });
+}
+
+template <typename Op>
+static void morph(CImg<float> &img, int sx, int sy, bool wrap_x, bool wrap_y)
+{
+  if (img.is_empty())
+    return;
+
+  for (int c = 0; c < img.spectrum(); c++)
+  {
+    for (int z = 0; z < img.depth(); z++)
+    {
+      float *plane = img.data(0, 0, z, c);
+      if (sx > 1 && img.width() > 1)
+        morph_axis<Op>(plane, img.width(), img.height(), true, sx, wrap_x);
+      if (sy > 1 && img.height() > 1)
+        morph_axis<Op>(plane, img.width(), img.height(), false, sy, wrap_y);
+    }
+  }
+}
+
+void dilate(CImg<float> &img, int sx, int sy, bool wrap_x, bool wrap_y)
+{
+  morph<Max>(img, sx, sy, wrap_x, wrap_y);
+}
+
+void erode(CImg<float> &img, int sx, int sy, bool wrap_x, bool wrap_y)
+{
+  morph<Min>(img, sx, sy, wrap_x, wrap_y);
+}
@@ -0,0 +1,42 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef MORPHOLOGY_H
+#define MORPHOLOGY_H
+
+#define cimg_display 0
+#include "thirdparty/CImg.h"
+
+/* Grayscale dilation and erosion by an sx x sy rectangle, in place and per
+ * channel, with the same window placement as CImg::dilate and CImg::erode.
+ *
+ * Both axes use the van Herk / Gil-Werman scheme: lines are cut in blocks
+ * of the window length, and prefix and suffix extrema of the blocks give
+ * every window with three comparisons per pixel, whatever its size. Lines
+ * are processed in strips of neighbours so the loops vectorize, and the
+ * strips are spread over the threads.
+ *
+ * Pixels past the border are ignored, unless wrap_x or wrap_y make the
+ * image periodic along that axis. */
+void dilate(cimg_library::CImg<float> &img, int sx, int sy, bool wrap_x = false,
+            bool wrap_y = false);
+void erode(cimg_library::CImg<float> &img, int sx, int sy, bool wrap_x = false,
+           bool wrap_y = false);
+
+#endif // MORPHOLOGY_H
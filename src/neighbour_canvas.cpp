@@ -0,0 +1,355 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "neighbour_canvas.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+using namespace cimg_library;
+
+static std::atomic<quint64> next_version(1);
+
+/* A stretch of canvas coordinates along one axis that falls in one cell */
+struct Run
+{
+  int start, length;
+  /* Frame column (or row) of the block and cell, 0 to 2, in it */
+  int index, cell;
+  /* First coordinate inside the cell. Cell 0 lies left of (above) the
+   * frame, so its coordinates count back from the far edge of its
+   * content: the content coordinate is offset + content length. */
+  int offset;
+};
+
+/* Runs of [c0, c1] along an axis of the canvas with count frames of
+ * regular length, the last one taking the rest of total */
+static QVector<Run> axis_runs(int c0, int c1, int count, int regular, int total)
+{
+  QVector<Run> runs;
+  if (regular <= 0)
+    return runs;
+
+  int c = c0;
+  while (c <= c1)
+  {
+    const int k = std::min(c / (3 * regular), count - 1);
+    const int length = k == count - 1 ? total - k * regular : regular;
+    const int block = 3 * k * regular;
+    const int u = c - block - regular;
+
+    Run run;
+    run.start = c;
+    run.index = k;
+    int end;
+    if (u < 0)
+    {
+      run.cell = 0;
+      run.offset = u;
+      end = block + regular;
+    }
+    else if (u < length)
+    {
+      run.cell = 1;
+      run.offset = u;
+      end = block + regular + length;
+    }
+    else
+    {
+      run.cell = 2;
+      run.offset = u - length;
+      end = block + 3 * length;
+    }
+    run.length = std::min(end, c1 + 1) - c;
+    if (run.length <= 0)
+      break;
+    runs.append(run);
+    c += run.length;
+  }
+  return runs;
+}
+
+NeighbourCanvas::NeighbourCanvas() {}
+
+NeighbourCanvas::NeighbourCanvas(QSize sprite, int h_frames, int v_frames)
+    : m_layout(sprite, h_frames, v_frames, true), m_h(std::max(h_frames, 1)),
+      m_v(std::max(v_frames, 1)), m_cells(9 * m_h * m_v)
+{
+  reset(false);
+}
+
+void NeighbourCanvas::reset(bool wrap)
+{
+  if (m_cells.isEmpty())
+    return;
+  for (int i = 0; i < m_layout.count(); i++)
+  {
+    for (int y = 0; y < 3; y++)
+    {
+      for (int x = 0; x < 3; x++)
+      {
+        Cell cell;
+        cell.frame = neighbour(i, x - 1, y - 1, wrap);
+        at(i, x, y) = cell;
+      }
+    }
+  }
+  touch();
+}
+
+void NeighbourCanvas::set_image(int frame, int x, int y, const QImage &image)
+{
+  if (m_cells.isEmpty() || frame < 0 || frame >= m_layout.count() || x < 0 || x > 2 || y < 0 ||
+      y > 2)
+    return;
+
+  at(frame, x, y) = image.isNull() ? Cell() : image_cell(image, m_layout.frame(frame).size());
+  touch();
+}
+
+void NeighbourCanvas::set_image(int x, int y, const QImage &image)
+{
+  for (int i = 0; i < m_layout.count(); i++)
+  {
+    set_image(i, x, y, image);
+  }
+}
+
+void NeighbourCanvas::restore(const QImage &canvas, const QImage &sheet)
+{
+  if (m_cells.isEmpty() || canvas.size() != m_layout.source_size())
+    return;
+
+  const PlanarImage stored = PlanarImage::from_qimage(canvas.convertToFormat(QImage::Format_RGBA8888));
+  const PlanarImage frames = PlanarImage::from_qimage(sheet.convertToFormat(QImage::Format_RGBA8888));
+  const int regular_w = m_layout.frame(0).width(), regular_h = m_layout.frame(0).height();
+  for (int i = 0; i < m_layout.count(); i++)
+  {
+    const QRect f = m_layout.frame(i);
+    const int xs[4] = {0, regular_w, regular_w + f.width(), 3 * f.width()};
+    const int ys[4] = {0, regular_h, regular_h + f.height(), 3 * f.height()};
+    for (int y = 0; y < 3; y++)
+    {
+      for (int x = 0; x < 3; x++)
+      {
+        QRect r(3 * f.left() + xs[x], 3 * f.top() + ys[y], xs[x + 1] - xs[x], ys[y + 1] - ys[y]);
+        if (r.isEmpty())
+          continue;
+        const CImg<uchar> pixels = stored.view().get_crop(r.left(), r.top(), r.right(), r.bottom());
+
+        Cell found;
+        if (pixels.max() != 0)
+        {
+          QImage image = canvas.copy(r).convertToFormat(QImage::Format_RGBA8888);
+          found = image_cell(image, image.size());
+          for (bool wrap : {false, true})
+          {
+            at(i, x, y) = Cell();
+            at(i, x, y).frame = neighbour(i, x - 1, y - 1, wrap);
+            if (at(i, x, y).frame >= 0 && read(r, frames) == pixels)
+            {
+              found = at(i, x, y);
+              break;
+            }
+          }
+        }
+        at(i, x, y) = found;
+      }
+    }
+  }
+  touch();
+}
+
+NeighbourCanvas NeighbourCanvas::scaled(QSize sprite) const
+{
+  NeighbourCanvas out(sprite, m_h, m_v);
+  const QSize from = m_layout.sprite_size();
+  if (m_cells.size() != out.m_cells.size() || from.isEmpty())
+    return out;
+
+  out.m_cells = m_cells;
+  for (Cell &cell : out.m_cells)
+  {
+    if (cell.frame < 0 && !cell.image.isNull())
+    {
+      QSize size(std::max(cell.image.width() * sprite.width() / from.width(), 1),
+                 std::max(cell.image.height() * sprite.height() / from.height(), 1));
+      cell = image_cell(cell.image, size);
+    }
+  }
+  out.touch();
+  return out;
+}
+
+bool NeighbourCanvas::matches(QSize sprite, int h_frames, int v_frames) const
+{
+  return !m_cells.isEmpty() && m_layout.sprite_size() == sprite && m_h == h_frames && m_v == v_frames;
+}
+
+const FrameLayout &NeighbourCanvas::layout() const { return m_layout; }
+
+quint64 NeighbourCanvas::version() const { return m_version; }
+
+QImage NeighbourCanvas::cell(int frame, int x, int y, const QImage &sheet) const
+{
+  if (m_cells.isEmpty() || frame < 0 || frame >= m_layout.count())
+    return QImage();
+
+  const Cell &c = at(frame, x, y);
+  if (c.frame >= 0)
+    return sheet.copy(m_layout.frame(c.frame));
+  if (!c.image.isNull())
+    return c.image;
+
+  QImage empty(m_layout.frame(frame).size(), QImage::Format_RGBA8888_Premultiplied);
+  empty.fill(0);
+  return empty;
+}
+
+CImg<uchar> NeighbourCanvas::read(const QRect &r, const PlanarImage &sheet, int channel) const
+{
+  const int channels = channel < 0 ? sheet.channels() : 1;
+  CImg<uchar> out(std::max(r.width(), 0), std::max(r.height(), 0), 1, channels, 0);
+  if (r.isEmpty() || m_cells.isEmpty())
+    return out;
+
+  const QSize s = m_layout.sprite_size();
+  const bool has_frames = sheet.width() == s.width() && sheet.height() == s.height();
+  const QRect regular = m_layout.frame(0);
+  const QVector<Run> columns = axis_runs(r.left(), r.right(), m_h, regular.width(), s.width());
+  const QVector<Run> rows = axis_runs(r.top(), r.bottom(), m_v, regular.height(), s.height());
+
+  for (const Run &ry : rows)
+  {
+    for (const Run &rx : columns)
+    {
+      const Cell &cell = at(ry.index * m_h + rx.index, rx.cell, ry.cell);
+      PlanarImage planes;
+      QRect content;
+      if (cell.frame >= 0)
+      {
+        if (!has_frames)
+          continue;
+        planes = sheet;
+        content = m_layout.frame(cell.frame);
+      }
+      else
+      {
+        planes = sheet.channels() == 1 ? cell.gray : cell.rgba;
+        if (planes.is_empty())
+          continue;
+        content = QRect(0, 0, planes.width(), planes.height());
+      }
+
+      /* The run inside the content, the rest stays transparent */
+      const int lx = rx.cell == 0 ? rx.offset + content.width() : rx.offset;
+      const int ly = ry.cell == 0 ? ry.offset + content.height() : ry.offset;
+      const int x0 = std::max(0, -lx), x1 = std::min(rx.length, content.width() - lx);
+      const int y0 = std::max(0, -ly), y1 = std::min(ry.length, content.height() - ly);
+      if (x1 <= x0 || y1 <= y0)
+        continue;
+
+      for (int c = 0; c < channels; c++)
+      {
+        const int from = channel < 0 ? c : channel;
+        if (from >= planes.channels())
+          continue;
+        const uchar *plane = planes.plane(from);
+        for (int y = y0; y < y1; y++)
+        {
+          const uchar *src = plane + static_cast<size_t>(content.top() + ly + y) * planes.width() +
+                             content.left() + lx + x0;
+          memcpy(out.data(rx.start - r.left() + x0, ry.start - r.top() + y, 0, c), src, x1 - x0);
+        }
+      }
+    }
+  }
+  return out;
+}
+
+QVector<quint64> NeighbourCanvas::block_hashes(const QVector<quint64> &frame_hashes) const
+{
+  QVector<quint64> hashes(m_layout.count());
+  for (int i = 0; i < m_layout.count(); i++)
+  {
+    const QRect block = m_layout.source(i);
+    quint64 h = static_cast<quint64>(block.width()) << 32 | static_cast<quint32>(block.height());
+    for (int c = 0; c < 9; c++)
+    {
+      const Cell &cell = m_cells[9 * i + c];
+      quint64 words[2] = {static_cast<quint64>(cell.frame + 1),
+                          cell.frame >= 0 ? frame_hashes.value(cell.frame) : cell.hash};
+      h = hash_bytes(reinterpret_cast<const uchar *>(words), sizeof(words), h);
+    }
+    hashes[i] = h;
+  }
+  return hashes;
+}
+
+QImage NeighbourCanvas::to_image(const QImage &sheet) const
+{
+  const QSize size = m_layout.source_size();
+  if (size.isEmpty() || m_cells.isEmpty())
+    return QImage();
+
+  const PlanarImage frames = PlanarImage::from_qimage(sheet.convertToFormat(QImage::Format_RGBA8888));
+  const CImg<uchar> pixels = read(QRect(QPoint(0, 0), size), frames);
+  PlanarImage planes(size.width(), size.height(), 4);
+  memcpy(planes.plane(0), pixels.data(), pixels.size());
+  return planes.to_qimage();
+}
+
+NeighbourCanvas::Cell NeighbourCanvas::image_cell(const QImage &image, QSize size)
+{
+  Cell cell;
+  cell.image = image;
+  if (size.isValid() && image.size() != size)
+  {
+    cell.image = cell.image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+  }
+  cell.image = cell.image.convertToFormat(QImage::Format_RGBA8888);
+  cell.rgba = PlanarImage::from_qimage(cell.image);
+  cell.gray = PlanarImage::from_qimage(cell.image.convertToFormat(QImage::Format_Grayscale8));
+  /* 0 stands for nothing */
+  cell.hash = region_hashes(cell.rgba, {cell.image.rect()}).value(0) | 1;
+  return cell;
+}
+
+int NeighbourCanvas::neighbour(int frame, int dx, int dy, bool wrap) const
+{
+  int x = frame % m_h + dx, y = frame / m_h + dy;
+  if (wrap)
+  {
+    x = (x + m_h) % m_h;
+    y = (y + m_v) % m_v;
+  }
+  if (x < 0 || y < 0 || x >= m_h || y >= m_v)
+    return -1;
+  return y * m_h + x;
+}
+
+NeighbourCanvas::Cell &NeighbourCanvas::at(int frame, int x, int y) { return m_cells[9 * frame + 3 * y + x]; }
+
+const NeighbourCanvas::Cell &NeighbourCanvas::at(int frame, int x, int y) const
+{
+  return m_cells[9 * frame + 3 * y + x];
+}
+
+void NeighbourCanvas::touch() { m_version = next_version++; }
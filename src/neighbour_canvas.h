@@ -0,0 +1,98 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef NEIGHBOURCANVAS_H
+#define NEIGHBOURCANVAS_H
+
+#include "src/frame_layout.h"
+#include "src/planar_image.h"
+
+#include <QImage>
+#include <QVector>
+
+/* The neighbours canvas of a tileable sprite, without the canvas. Frame i
+ * owns the block FrameLayout::source(i) of a virtual canvas three times the
+ * sprite size; the nine cells of the block show the frame in the middle and
+ * the neighbours chosen for it around. A cell shows a frame of the sheet,
+ * an image of its own (a file or a copy picked in NBSelector), or nothing.
+ *
+ * Reads map every canvas pixel to its cell and the cell to its pixels, so
+ * only the regions the stages ask for ever exist. Copies are cheap, the
+ * cell images are implicitly shared. */
+class NeighbourCanvas
+{
+public:
+  NeighbourCanvas();
+  /* Cells as reset(false) leaves them */
+  NeighbourCanvas(QSize sprite, int h_frames, int v_frames);
+
+  /* Every cell shows the frame next to it on the sheet; past the edges of
+   * the sheet nothing, or with wrap the frame on the other side */
+  void reset(bool wrap);
+  /* Cell (x, y), both in [0, 2], of frame shows image, scaled to the frame
+   * size, or nothing when image is null */
+  void set_image(int frame, int x, int y, const QImage &image);
+  /* The same for every frame */
+  void set_image(int x, int y, const QImage &image);
+  /* Cells from a materialized canvas, as older projects store it. Cells
+   * that show a frame of sheet keep pointing at it. */
+  void restore(const QImage &canvas, const QImage &sheet);
+  /* Same cells for the sprite scaled to sprite */
+  NeighbourCanvas scaled(QSize sprite) const;
+
+  bool matches(QSize sprite, int h_frames, int v_frames) const;
+  const FrameLayout &layout() const;
+  /* Changes with every modification, for the stage keys */
+  quint64 version() const;
+
+  /* Pixels of cell (x, y) of frame; sheet supplies the frames */
+  QImage cell(int frame, int x, int y, const QImage &sheet) const;
+  /* Region r of the canvas, with the frames read from the sprite sized
+   * planes of sheet: all channels, or only channel. Cell images are taken
+   * in the format of sheet (gray for one channel, RGBA for four). */
+  cimg_library::CImg<uchar> read(const QRect &r, const PlanarImage &sheet, int channel = -1) const;
+  /* Content hash of every frame's block, from the hashes of the frames of
+   * the sheet */
+  QVector<quint64> block_hashes(const QVector<quint64> &frame_hashes) const;
+  /* The whole canvas, for saving */
+  QImage to_image(const QImage &sheet) const;
+
+private:
+  struct Cell
+  {
+    /* Frame of the sheet shown, -1 for the image or nothing */
+    int frame = -1;
+    QImage image;
+    PlanarImage rgba, gray;
+    quint64 hash = 0;
+  };
+
+  static Cell image_cell(const QImage &image, QSize size);
+  int neighbour(int frame, int dx, int dy, bool wrap) const;
+  Cell &at(int frame, int x, int y);
+  const Cell &at(int frame, int x, int y) const;
+  void touch();
+
+  FrameLayout m_layout;
+  int m_h = 1, m_v = 1;
+  QVector<Cell> m_cells;
+  quint64 m_version = 0;
+};
+
+#endif // NEIGHBOURCANVAS_H
@@ -0,0 +1,293 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "normal_kernels.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LAIGTER_X86_DISPATCH
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/* Smallest norm accepted before dividing, avoids NaN on null vectors */
+static const float min_norm = 1e-12f;
+
+static void normal_span_scalar(const float *row, const float *const *gy_rows, const float *gy_coef,
+                               const uchar *alpha, int count, float kx, float ky,
+                               float *nx, float *ny, float *nz)
+{
+  for (int i = 0; i < count; i++)
+  {
+    float dx = row[i + 1] - row[i - 1];
+    float dy = gy_coef[0] * gy_rows[0][i] + gy_coef[1] * gy_rows[1][i] + gy_coef[2] * gy_rows[2][i];
+    bool opaque = alpha[i] != 0;
+    nx[i] = opaque ? -dx * kx : 0.0f;
+    ny[i] = opaque ? dy * ky : 0.0f;
+    nz[i] = 1.0f;
+  }
+}
+
+static void encode_span_scalar(const float *x, const float *y, const float *z, int count,
+                               float *ox, float *oy, float *oz)
+{
+  for (int i = 0; i < count; i++)
+  {
+    float norm = sqrtf(x[i] * x[i] + y[i] * y[i] + z[i] * z[i]);
+    float s = 127.5f / (norm > min_norm ? norm : min_norm);
+    float vx = x[i] * s + 127.5f, vy = y[i] * s + 127.5f, vz = z[i] * s + 127.5f;
+    ox[i] = vx;
+    oy[i] = vy;
+    oz[i] = vz;
+  }
+}
+
+#ifdef LAIGTER_X86_DISPATCH
+
+TARGET("sse2")
+static void normal_span_sse2(const float *row, const float *const *gy_rows, const float *gy_coef,
+                             const uchar *alpha, int count, float kx, float ky,
+                             float *nx, float *ny, float *nz)
+{
+  const __m128 vkx = _mm_set1_ps(-kx), vky = _mm_set1_ps(ky), one = _mm_set1_ps(1.0f);
+  const __m128 c0 = _mm_set1_ps(gy_coef[0]), c1 = _mm_set1_ps(gy_coef[1]), c2 = _mm_set1_ps(gy_coef[2]);
+  const __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 dx = _mm_sub_ps(_mm_loadu_ps(row + i + 1), _mm_loadu_ps(row + i - 1));
+    __m128 dy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_loadu_ps(gy_rows[0] + i)),
+                                      _mm_mul_ps(c1, _mm_loadu_ps(gy_rows[1] + i))),
+                           _mm_mul_ps(c2, _mm_loadu_ps(gy_rows[2] + i)));
+    int a;
+    memcpy(&a, alpha + i, sizeof(a));
+    __m128i a32 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(a), zero), zero);
+    __m128 opaque = _mm_castsi128_ps(_mm_xor_si128(_mm_cmpeq_epi32(a32, zero), _mm_set1_epi32(-1)));
+    _mm_storeu_ps(nx + i, _mm_and_ps(opaque, _mm_mul_ps(dx, vkx)));
+    _mm_storeu_ps(ny + i, _mm_and_ps(opaque, _mm_mul_ps(dy, vky)));
+    _mm_storeu_ps(nz + i, one);
+  }
+  const float *tail_rows[3] = {gy_rows[0] + i, gy_rows[1] + i, gy_rows[2] + i};
+  normal_span_scalar(row + i, tail_rows, gy_coef, alpha + i, count - i, kx, ky, nx + i, ny + i, nz + i);
+}
+
+TARGET("sse2")
+static void encode_span_sse2(const float *x, const float *y, const float *z, int count,
+                             float *ox, float *oy, float *oz)
+{
+  const __m128 half = _mm_set1_ps(127.5f), eps = _mm_set1_ps(min_norm);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i), vz = _mm_loadu_ps(z + i);
+    __m128 n2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+    __m128 s = _mm_div_ps(half, _mm_max_ps(_mm_sqrt_ps(n2), eps));
+    _mm_storeu_ps(ox + i, _mm_add_ps(_mm_mul_ps(vx, s), half));
+    _mm_storeu_ps(oy + i, _mm_add_ps(_mm_mul_ps(vy, s), half));
+    _mm_storeu_ps(oz + i, _mm_add_ps(_mm_mul_ps(vz, s), half));
+  }
+  encode_span_scalar(x + i, y + i, z + i, count - i, ox + i, oy + i, oz + i);
+}
+
+TARGET("avx2,fma")
+static void normal_span_avx2(const float *row, const float *const *gy_rows, const float *gy_coef,
+                             const uchar *alpha, int count, float kx, float ky,
+                             float *nx, float *ny, float *nz)
+{
+  const __m256 vkx = _mm256_set1_ps(-kx), vky = _mm256_set1_ps(ky), one = _mm256_set1_ps(1.0f);
+  const __m256 c0 = _mm256_set1_ps(gy_coef[0]), c1 = _mm256_set1_ps(gy_coef[1]), c2 = _mm256_set1_ps(gy_coef[2]);
+  const __m256i zero = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(row + i + 1), _mm256_loadu_ps(row + i - 1));
+    __m256 dy = _mm256_mul_ps(c0, _mm256_loadu_ps(gy_rows[0] + i));
+    dy = _mm256_fmadd_ps(c1, _mm256_loadu_ps(gy_rows[1] + i), dy);
+    dy = _mm256_fmadd_ps(c2, _mm256_loadu_ps(gy_rows[2] + i), dy);
+    __m256i a32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(alpha + i)));
+    __m256 transparent = _mm256_castsi256_ps(_mm256_cmpeq_epi32(a32, zero));
+    _mm256_storeu_ps(nx + i, _mm256_andnot_ps(transparent, _mm256_mul_ps(dx, vkx)));
+    _mm256_storeu_ps(ny + i, _mm256_andnot_ps(transparent, _mm256_mul_ps(dy, vky)));
+    _mm256_storeu_ps(nz + i, one);
+  }
+  const float *tail_rows[3] = {gy_rows[0] + i, gy_rows[1] + i, gy_rows[2] + i};
+  normal_span_scalar(row + i, tail_rows, gy_coef, alpha + i, count - i, kx, ky, nx + i, ny + i, nz + i);
+}
+
+TARGET("avx2,fma")
+static void encode_span_avx2(const float *x, const float *y, const float *z, int count,
+                             float *ox, float *oy, float *oz)
+{
+  const __m256 half = _mm256_set1_ps(127.5f), eps = _mm256_set1_ps(min_norm);
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256 vx = _mm256_loadu_ps(x + i), vy = _mm256_loadu_ps(y + i), vz = _mm256_loadu_ps(z + i);
+    __m256 n2 = _mm256_fmadd_ps(vx, vx, _mm256_fmadd_ps(vy, vy, _mm256_mul_ps(vz, vz)));
+    __m256 s = _mm256_div_ps(half, _mm256_max_ps(_mm256_sqrt_ps(n2), eps));
+    _mm256_storeu_ps(ox + i, _mm256_fmadd_ps(vx, s, half));
+    _mm256_storeu_ps(oy + i, _mm256_fmadd_ps(vy, s, half));
+    _mm256_storeu_ps(oz + i, _mm256_fmadd_ps(vz, s, half));
+  }
+  encode_span_scalar(x + i, y + i, z + i, count - i, ox + i, oy + i, oz + i);
+}
+
+/* The unmasked forms of some AVX-512 intrinsics pass an undefined vector
+ * through, which GCC warns about as maybe uninitialized; the zero masked
+ * forms with every lane set are the same instructions. */
+static const __mmask16 all_lanes = 0xffff;
+
+TARGET("avx512f")
+static void normal_span_avx512(const float *row, const float *const *gy_rows, const float *gy_coef,
+                               const uchar *alpha, int count, float kx, float ky,
+                               float *nx, float *ny, float *nz)
+{
+  const __m512 vkx = _mm512_set1_ps(-kx), vky = _mm512_set1_ps(ky), one = _mm512_set1_ps(1.0f);
+  const __m512 c0 = _mm512_set1_ps(gy_coef[0]), c1 = _mm512_set1_ps(gy_coef[1]), c2 = _mm512_set1_ps(gy_coef[2]);
+  int i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(row + i + 1), _mm512_loadu_ps(row + i - 1));
+    __m512 dy = _mm512_mul_ps(c0, _mm512_loadu_ps(gy_rows[0] + i));
+    dy = _mm512_fmadd_ps(c1, _mm512_loadu_ps(gy_rows[1] + i), dy);
+    dy = _mm512_fmadd_ps(c2, _mm512_loadu_ps(gy_rows[2] + i), dy);
+    __m512i a32 = _mm512_maskz_cvtepu8_epi32(all_lanes, _mm_loadu_si128(reinterpret_cast<const __m128i *>(alpha + i)));
+    __mmask16 opaque = _mm512_test_epi32_mask(a32, a32);
+    _mm512_storeu_ps(nx + i, _mm512_maskz_mul_ps(opaque, dx, vkx));
+    _mm512_storeu_ps(ny + i, _mm512_maskz_mul_ps(opaque, dy, vky));
+    _mm512_storeu_ps(nz + i, one);
+  }
+  const float *tail_rows[3] = {gy_rows[0] + i, gy_rows[1] + i, gy_rows[2] + i};
+  normal_span_scalar(row + i, tail_rows, gy_coef, alpha + i, count - i, kx, ky, nx + i, ny + i, nz + i);
+}
+
+TARGET("avx512f")
+static void encode_span_avx512(const float *x, const float *y, const float *z, int count,
+                               float *ox, float *oy, float *oz)
+{
+  const __m512 half = _mm512_set1_ps(127.5f), eps = _mm512_set1_ps(min_norm);
+  int i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m512 vx = _mm512_loadu_ps(x + i), vy = _mm512_loadu_ps(y + i), vz = _mm512_loadu_ps(z + i);
+    __m512 n2 = _mm512_fmadd_ps(vx, vx, _mm512_fmadd_ps(vy, vy, _mm512_mul_ps(vz, vz)));
+    __m512 s = _mm512_div_ps(half, _mm512_maskz_max_ps(all_lanes, _mm512_maskz_sqrt_ps(all_lanes, n2), eps));
+    _mm512_storeu_ps(ox + i, _mm512_fmadd_ps(vx, s, half));
+    _mm512_storeu_ps(oy + i, _mm512_fmadd_ps(vy, s, half));
+    _mm512_storeu_ps(oz + i, _mm512_fmadd_ps(vz, s, half));
+  }
+  encode_span_scalar(x + i, y + i, z + i, count - i, ox + i, oy + i, oz + i);
+}
+
+#endif // LAIGTER_X86_DISPATCH
+
+static NormalKernels select_kernels()
+{
+  NormalKernels k = {normal_span_scalar, encode_span_scalar, "scalar"};
+
+#ifdef LAIGTER_X86_DISPATCH
+  const char *env = getenv("LAIGTER_SIMD");
+  int limit = 3;
+  if (env)
+  {
+    if (!strcmp(env, "scalar"))
+      limit = 0;
+    else if (!strcmp(env, "sse2"))
+      limit = 1;
+    else if (!strcmp(env, "avx2"))
+      limit = 2;
+  }
+
+  __builtin_cpu_init();
+  if (limit >= 1 && __builtin_cpu_supports("sse2"))
+  {
+    k = {normal_span_sse2, encode_span_sse2, "sse2"};
+  }
+  if (limit >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+  {
+    k = {normal_span_avx2, encode_span_avx2, "avx2"};
+  }
+  if (limit >= 3 && __builtin_cpu_supports("avx512f"))
+  {
+    k = {normal_span_avx512, encode_span_avx512, "avx512"};
+  }
+#endif
+
+  return k;
+}
+
+const NormalKernels &normal_kernels()
+{
+  static const NormalKernels kernels = select_kernels();
+  return kernels;
+}
+
+void compose_normal_span(const NormalComposeRow &row, int count)
+{
+  /* Work in chunks that stay in L1, the encode step runs on the SIMD kernel */
+  const int chunk = 64;
+  float n[3][chunk];
+  const NormalKernels &kernels = normal_kernels();
+
+  for (int start = 0; start < count; start += chunk)
+  {
+    const int len = count - start < chunk ? count - start : chunk;
+    for (int c = 0; c < 3; c++)
+    {
+      const float *e = row.emboss[c] + start;
+      const float *b = row.bevel[c] + start;
+      const float *h = row.height[c] + start;
+      const float inv = row.invert[c];
+      for (int i = 0; i < len; i++)
+      {
+        n[c][i] = inv * (1.5f * e[i] + 1.5f * b[i] + h[i]);
+      }
+    }
+
+    if (row.overlay)
+    {
+      /* Painted colors are premultiplied, so the unpremultiplied blend
+       * n * (1 - a) + (2 * color - 1) * a reduces to n * (1 - a) + 2 * p - a */
+      const uchar *ov = row.overlay + 4 * start;
+      for (int i = 0; i < len; i++)
+      {
+        const float a = ov[4 * i + 3] * (1.0f / 255.0f);
+        for (int c = 0; c < 3; c++)
+        {
+          n[c][i] = n[c][i] * (1.0f - a) + ov[4 * i + c] * (2.0f / 255.0f) - a;
+        }
+      }
+    }
+
+    kernels.encode_span(n[0], n[1], n[2], len, n[0], n[1], n[2]);
+
+    uchar *out = row.out + 3 * start;
+    for (int i = 0; i < len; i++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        const float v = n[c][i];
+        out[3 * i + c] = v <= 0.0f ? 0 : v >= 255.0f ? 255 : static_cast<uchar>(v);
+      }
+    }
+  }
+}
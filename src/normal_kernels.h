@@ -0,0 +1,67 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef NORMALKERNELS_H
+#define NORMALKERNELS_H
+
+typedef unsigned char uchar;
+
+/* Row kernels of the normal stage. Every entry exists as scalar, SSE2, AVX2
+ * and AVX-512 code; normal_kernels() picks the widest one the running CPU
+ * supports, so a single binary works on every x86 machine. The LAIGTER_SIMD
+ * environment variable (scalar, sse2, avx2, avx512) caps the choice. */
+struct NormalKernels
+{
+  /* Gradient and normal assembly for count pixels starting at row[0]:
+   *   dx = row[i + 1] - row[i - 1]
+   *   dy = sum(gy_coef[k] * gy_rows[k][i])
+   *   n  = (-dx * kx, dy * ky, 1), or (0, 0, 1) where alpha[i] == 0
+   * row[-1] and row[count] must be readable. */
+  void (*normal_span)(const float *row, const float *const *gy_rows, const float *gy_coef,
+                      const uchar *alpha, int count, float kx, float ky,
+                      float *nx, float *ny, float *nz);
+
+  /* Normalizes (x, y, z) and encodes it to [0, 255]: o = 255 * (n / |n| * 0.5 + 0.5).
+   * Outputs may alias the inputs. */
+  void (*encode_span)(const float *x, const float *y, const float *z, int count,
+                      float *ox, float *oy, float *oz);
+
+  const char *name;
+};
+
+const NormalKernels &normal_kernels();
+
+/* One row of the final normal composition. Planes hold x, y and z. */
+struct NormalComposeRow
+{
+  const float *emboss[3];
+  const float *bevel[3];
+  const float *height[3];
+  /* RGBA8888_Premultiplied painted normals, or nullptr */
+  const uchar *overlay;
+  float invert[3];
+  /* RGB888 output */
+  uchar *out;
+};
+
+/* Fused composition: n = invert * (1.5 emboss + 1.5 bevel + height), blended
+ * under the overlay, normalized and written as 8 bit in a single pass. */
+void compose_normal_span(const NormalComposeRow &row, int count);
+
+#endif // NORMALKERNELS_H
@@ -0,0 +1,133 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "occupancy.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+Occupancy::Occupancy() {}
+
+Occupancy::Occupancy(const PlanarImage &planes, int alpha, const PlanarImage &gray)
+{
+  const bool has_alpha = !planes.is_empty() && alpha < planes.channels();
+  const bool has_gray = !gray.is_empty() &&
+                        (!has_alpha || (gray.width() == planes.width() && gray.height() == planes.height()));
+  if (!has_alpha && !has_gray)
+    return;
+
+  m_size = has_alpha ? QSize(planes.width(), planes.height()) : QSize(gray.width(), gray.height());
+  m_columns = (m_size.width() + cell_side - 1) / cell_side;
+  m_rows = (m_size.height() + cell_side - 1) / cell_side;
+  m_flags.fill(0, m_columns * m_rows);
+  m_gray.fill(0, m_columns * m_rows);
+
+  const uchar *a = has_alpha ? planes.plane(alpha) : nullptr;
+  const uchar *g = has_gray ? gray.plane(0) : nullptr;
+  const int width = m_size.width();
+  uchar *flags = m_flags.data();
+  uchar *grays = m_gray.data();
+  /* A band of cells per job, rows are read in memory order */
+  parallel_for(m_rows, m_rows > 1, [&](int row) {
+    for (int column = 0; column < m_columns; column++)
+    {
+      const QRect r = cell_rect(column, row);
+      const int i = row * m_columns + column;
+      bool opaque = !a, flat = g != nullptr;
+      const uchar value = g ? g[static_cast<size_t>(r.top()) * width + r.left()] : 0;
+      for (int y = r.top(); y <= r.bottom() && (!opaque || flat); y++)
+      {
+        const size_t line = static_cast<size_t>(y) * width + r.left();
+        for (int x = 0; x < r.width() && a && !opaque; x++)
+        {
+          opaque = a[line + x] != 0;
+        }
+        for (int x = 0; x < r.width() && flat; x++)
+        {
+          flat = g[line + x] == value;
+        }
+      }
+      flags[i] = (opaque ? Opaque : 0) | (flat ? Flat : 0);
+      grays[i] = value;
+    }
+  });
+}
+
+bool Occupancy::is_empty() const { return m_flags.isEmpty(); }
+
+/* Columns and rows of the cells touching r */
+QRect Occupancy::cells(const QRect &r) const
+{
+  const QRect a = r.intersected(QRect(QPoint(0, 0), m_size));
+  if (a.isEmpty())
+    return QRect();
+  return QRect(QPoint(a.left() / cell_side, a.top() / cell_side),
+               QPoint(a.right() / cell_side, a.bottom() / cell_side));
+}
+
+QRect Occupancy::cell_rect(int column, int row) const
+{
+  return QRect(column * cell_side, row * cell_side, cell_side, cell_side)
+      .intersected(QRect(QPoint(0, 0), m_size));
+}
+
+QRect Occupancy::opaque_bounds(const QRect &r) const
+{
+  if (is_empty())
+    return r;
+
+  QRect bounds;
+  const QRect c = cells(r);
+  for (int row = c.top(); row <= c.bottom(); row++)
+  {
+    for (int column = c.left(); column <= c.right(); column++)
+    {
+      if (m_flags[row * m_columns + column] & Opaque)
+        bounds |= cell_rect(column, row);
+    }
+  }
+  return bounds.intersected(r);
+}
+
+QRect Occupancy::varied_bounds(const QRect &r, bool transparent, int *value) const
+{
+  *value = -1;
+  if (is_empty())
+    return r;
+
+  const uchar mask = transparent ? (Flat | Opaque) : Flat;
+  QRect bounds;
+  const QRect c = cells(r);
+  for (int row = c.top(); row <= c.bottom(); row++)
+  {
+    for (int column = c.left(); column <= c.right(); column++)
+    {
+      const int i = row * m_columns + column;
+      const bool flat = (m_flags[i] & mask) == Flat;
+      if (flat && *value < 0)
+        *value = m_gray[i];
+      if (!flat || m_gray[i] != *value)
+        bounds |= cell_rect(column, row);
+    }
+  }
+  if (*value < 0)
+    return r;
+  return bounds.intersected(r);
+}
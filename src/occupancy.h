@@ -0,0 +1,70 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include "src/planar_image.h"
+
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+/* Coarse map of a sprite in square cells: which cells have a pixel that is
+ * not fully transparent, and which have the same gray everywhere. It is
+ * made once per source, and lets the stages fast fill what is transparent
+ * or flat instead of filtering it. Coordinates are those of the sprite. */
+class Occupancy
+{
+public:
+  static const int cell_side = 32;
+
+  Occupancy();
+  /* Cells of planes, whose channel alpha is the opacity, and of gray, a
+   * one channel plane of the same size. Either may be empty: without alpha
+   * every cell counts as opaque, without gray none as flat. */
+  Occupancy(const PlanarImage &planes, int alpha, const PlanarImage &gray);
+
+  bool is_empty() const;
+  /* Bounds of the cells of r with a pixel that is not transparent, clipped
+   * to r, or a null rect when all of r is transparent */
+  QRect opaque_bounds(const QRect &r) const;
+  /* Bounds of the cells of r that don't have gray *value everywhere,
+   * clipped to r, with *value the gray of the first flat cell of r. Only
+   * transparent cells count as flat when transparent is set. r itself and
+   * *value -1 when no cell of r is flat. */
+  QRect varied_bounds(const QRect &r, bool transparent, int *value) const;
+
+private:
+  enum Flags
+  {
+    Opaque = 1,
+    Flat = 2
+  };
+  QRect cells(const QRect &r) const;
+  QRect cell_rect(int column, int row) const;
+
+  QSize m_size;
+  int m_columns = 0, m_rows = 0;
+  QVector<uchar> m_flags;
+  /* Gray of the flat cells */
+  QVector<uchar> m_gray;
+};
+
+#endif // OCCUPANCY_H
@@ -0,0 +1,279 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "planar_image.h"
+#include "worker_pool.h"
+
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace cimg_library;
+
+static void deinterleave_row(const uchar *src, int width, int channels, uchar *const *dst)
+{
+  int x = 0;
+#ifdef __SSE2__
+  if (channels == 4)
+  {
+    /* 16 pixels per step: three rounds of byte unpacks sort the bytes by
+     * channel, the last one splits the registers into planes. */
+    for (; x + 16 <= width; x += 16)
+    {
+      const __m128i *s = reinterpret_cast<const __m128i *>(src + 4 * x);
+      __m128i v0 = _mm_loadu_si128(s), v1 = _mm_loadu_si128(s + 1);
+      __m128i v2 = _mm_loadu_si128(s + 2), v3 = _mm_loadu_si128(s + 3);
+
+      __m128i a0 = _mm_unpacklo_epi8(v0, v1), a1 = _mm_unpackhi_epi8(v0, v1);
+      __m128i a2 = _mm_unpacklo_epi8(v2, v3), a3 = _mm_unpackhi_epi8(v2, v3);
+      __m128i b0 = _mm_unpacklo_epi8(a0, a1), b1 = _mm_unpackhi_epi8(a0, a1);
+      __m128i b2 = _mm_unpacklo_epi8(a2, a3), b3 = _mm_unpackhi_epi8(a2, a3);
+      __m128i c0 = _mm_unpacklo_epi8(b0, b1), c1 = _mm_unpackhi_epi8(b0, b1);
+      __m128i c2 = _mm_unpacklo_epi8(b2, b3), c3 = _mm_unpackhi_epi8(b2, b3);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst[0] + x), _mm_unpacklo_epi64(c0, c2));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst[1] + x), _mm_unpackhi_epi64(c0, c2));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst[2] + x), _mm_unpacklo_epi64(c1, c3));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst[3] + x), _mm_unpackhi_epi64(c1, c3));
+    }
+  }
+#endif
+  if (channels == 1)
+  {
+    memcpy(dst[0], src, width);
+    return;
+  }
+  for (; x < width; x++)
+  {
+    for (int c = 0; c < channels; c++)
+    {
+      dst[c][x] = src[channels * x + c];
+    }
+  }
+}
+
+static void interleave_row(const uchar *const *src, int width, int channels, uchar *dst)
+{
+  int x = 0;
+#ifdef __SSE2__
+  if (channels == 4)
+  {
+    for (; x + 16 <= width; x += 16)
+    {
+      __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[0] + x));
+      __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[1] + x));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[2] + x));
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[3] + x));
+
+      __m128i rg0 = _mm_unpacklo_epi8(r, g), rg1 = _mm_unpackhi_epi8(r, g);
+      __m128i ba0 = _mm_unpacklo_epi8(b, a), ba1 = _mm_unpackhi_epi8(b, a);
+
+      __m128i *d = reinterpret_cast<__m128i *>(dst + 4 * x);
+      _mm_storeu_si128(d, _mm_unpacklo_epi16(rg0, ba0));
+      _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(rg0, ba0));
+      _mm_storeu_si128(d + 2, _mm_unpacklo_epi16(rg1, ba1));
+      _mm_storeu_si128(d + 3, _mm_unpackhi_epi16(rg1, ba1));
+    }
+  }
+#endif
+  if (channels == 1)
+  {
+    memcpy(dst, src[0], width);
+    return;
+  }
+  for (; x < width; x++)
+  {
+    for (int c = 0; c < channels; c++)
+    {
+      dst[channels * x + c] = src[c][x];
+    }
+  }
+}
+
+/* Truncating float to 8 bit conversion, saturated to [0, 255]. NaN gives
+ * 0, in the SSE2 loop (maxps returns its second operand) and the tail. */
+static void pack_row(const float *src, int width, uchar *dst)
+{
+  int x = 0;
+#ifdef __SSE2__
+  const __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(255.0f);
+  auto clamp = [&](const float *p) { return _mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), zero), top); };
+  for (; x + 16 <= width; x += 16)
+  {
+    __m128i i0 = _mm_cvttps_epi32(clamp(src + x));
+    __m128i i1 = _mm_cvttps_epi32(clamp(src + x + 4));
+    __m128i i2 = _mm_cvttps_epi32(clamp(src + x + 8));
+    __m128i i3 = _mm_cvttps_epi32(clamp(src + x + 12));
+    __m128i w0 = _mm_packs_epi32(i0, i1), w1 = _mm_packs_epi32(i2, i3);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(w0, w1));
+  }
+#endif
+  for (; x < width; x++)
+  {
+    float v = src[x];
+    dst[x] = !(v > 0.0f) ? 0 : v >= 255.0f ? 255 : static_cast<uchar>(v);
+  }
+}
+
+void deinterleave_pixels(const uchar *src, int src_stride, int width, int height,
+                         int channels, uchar *dst)
+{
+  const size_t plane = static_cast<size_t>(width) * height;
+  parallel_for(height, plane > 65536, [&](int y) {
+    uchar *rows[4];
+    for (int c = 0; c < channels; c++)
+      rows[c] = dst + c * plane + static_cast<size_t>(y) * width;
+    deinterleave_row(src + static_cast<size_t>(y) * src_stride, width, channels, rows);
+  });
+}
+
+void interleave_pixels(const uchar *src, int width, int height, int channels,
+                       uchar *dst, int dst_stride)
+{
+  const size_t plane = static_cast<size_t>(width) * height;
+  parallel_for(height, plane > 65536, [&](int y) {
+    const uchar *rows[4];
+    for (int c = 0; c < channels; c++)
+      rows[c] = src + c * plane + static_cast<size_t>(y) * width;
+    interleave_row(rows, width, channels, dst + static_cast<size_t>(y) * dst_stride);
+  });
+}
+
+void interleave_pixels(const float *src, int width, int height, int channels,
+                       uchar *dst, int dst_stride)
+{
+  const size_t plane = static_cast<size_t>(width) * height;
+  parallel_for(height, plane > 65536, [&](int y) {
+    std::vector<uchar> packed(static_cast<size_t>(width) * channels);
+    const uchar *rows[4];
+    for (int c = 0; c < channels; c++)
+    {
+      uchar *row = packed.data() + static_cast<size_t>(c) * width;
+      pack_row(src + c * plane + static_cast<size_t>(y) * width, width, row);
+      rows[c] = row;
+    }
+    interleave_row(rows, width, channels, dst + static_cast<size_t>(y) * dst_stride);
+  });
+}
+
+int planar_channel_count(QImage::Format format)
+{
+  switch (format)
+  {
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+      return 4;
+    case QImage::Format_RGB888:
+      return 3;
+    case QImage::Format_Grayscale8:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+PlanarImage::PlanarImage() {}
+
+PlanarImage::PlanarImage(int width, int height, int channels)
+    : m_width(width), m_height(height), m_channels(channels)
+{
+  size_t n = static_cast<size_t>(width) * height * channels;
+  if (n > 0)
+    m_data = std::shared_ptr<uchar>(new uchar[n], std::default_delete<uchar[]>());
+}
+
+PlanarImage PlanarImage::from_qimage(const QImage &image)
+{
+  QImage in = image;
+  switch (in.format())
+  {
+    case QImage::Format_RGB32:
+      in = in.convertToFormat(QImage::Format_RGB888);
+      break;
+    case QImage::Format_ARGB32:
+      in = in.convertToFormat(QImage::Format_RGBA8888);
+      break;
+    case QImage::Format_ARGB32_Premultiplied:
+      in = in.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
+      break;
+    default:
+      break;
+  }
+
+  PlanarImage out(in.width(), in.height(), planar_channel_count(in.format()));
+  if (out.is_empty())
+    return out;
+
+  deinterleave_pixels(in.constBits(), in.bytesPerLine(), out.m_width, out.m_height,
+                      out.m_channels, out.m_data.get());
+  return out;
+}
+
+QImage PlanarImage::to_qimage() const
+{
+  QImage::Format format;
+  switch (m_channels)
+  {
+    case 1:
+      format = QImage::Format_Grayscale8;
+      break;
+    case 3:
+      format = QImage::Format_RGB888;
+      break;
+    case 4:
+      format = QImage::Format_RGBA8888;
+      break;
+    default:
+      return QImage();
+  }
+
+  QImage out(m_width, m_height, format);
+  interleave_pixels(m_data.get(), m_width, m_height, m_channels, out.bits(), out.bytesPerLine());
+  return out;
+}
+
+CImg<uchar> PlanarImage::view() const
+{
+  if (is_empty())
+    return CImg<uchar>();
+  return CImg<uchar>(m_data.get(), m_width, m_height, 1, m_channels, true);
+}
+
+CImg<uchar> PlanarImage::channel_view(int c) const
+{
+  if (is_empty())
+    return CImg<uchar>();
+  return CImg<uchar>(plane(c), m_width, m_height, 1, 1, true);
+}
+
+uchar *PlanarImage::plane(int c) const
+{
+  return m_data.get() + static_cast<size_t>(c) * m_width * m_height;
+}
+
+bool PlanarImage::is_empty() const { return !m_data; }
+
+int PlanarImage::width() const { return m_width; }
+
+int PlanarImage::height() const { return m_height; }
+
+int PlanarImage::channels() const { return m_channels; }
@@ -0,0 +1,70 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef PLANARIMAGE_H
+#define PLANARIMAGE_H
+
+#include <QImage>
+
+#include <memory>
+
+#define cimg_display 0
+#include "thirdparty/CImg.h"
+
+/* 8 bit image stored as one contiguous plane per channel, which is the
+ * layout CImg uses. Copies share the pixels, so a PlanarImage can be kept
+ * by a Texture and viewed by the processing stages without copying.
+ * Views do not own the pixels: keep the PlanarImage alive while using them. */
+class PlanarImage
+{
+public:
+  PlanarImage();
+  PlanarImage(int width, int height, int channels);
+
+  static PlanarImage from_qimage(const QImage &image);
+  QImage to_qimage() const;
+
+  cimg_library::CImg<uchar> view() const;
+  cimg_library::CImg<uchar> channel_view(int c) const;
+  uchar *plane(int c) const;
+
+  bool is_empty() const;
+  int width() const;
+  int height() const;
+  int channels() const;
+
+private:
+  std::shared_ptr<uchar> m_data;
+  int m_width = 0;
+  int m_height = 0;
+  int m_channels = 0;
+};
+
+int planar_channel_count(QImage::Format format);
+
+/* Bulk transposes between interleaved scanlines and planes. dst/src planes
+ * are width * height apart. */
+void deinterleave_pixels(const uchar *src, int src_stride, int width, int height,
+                         int channels, uchar *dst);
+void interleave_pixels(const uchar *src, int width, int height, int channels,
+                       uchar *dst, int dst_stride);
+void interleave_pixels(const float *src, int width, int height, int channels,
+                       uchar *dst, int dst_stride);
+
+#endif // PLANARIMAGE_H
@@ -16,6 +16,16 @@ extern "C"
 
 Project::Project(QObject *parent) : QObject(parent) {}
 
+/* Overlays are saved as PNG, projects of some builds have gray overlays as
+ * .overlay tile entries instead, see TiledOverlay::load */
+static void restore_overlay(ImageProcessor *p, TextureTypes type, const QString &path, const QByteArray &data)
+{
+  if (path.endsWith(".overlay"))
+    p->sprite.set_overlay(type, TiledOverlay::load(data));
+  else
+    p->sprite.set_image(type, QImage::fromData(data));
+}
+
 QString Project::GetCurrentPath()
 {
   return m_path;
@@ -83,7 +93,7 @@ bool Project::load(QString project_path, QList<ImageProcessor *> *p_list, QJsonO
       {
         zip_entry_read(zip, &buf, &bufsize);
         data.append((char *)buf, bufsize);
-        p->set_heightmap_overlay(QImage::fromData(data));
+        restore_overlay(p, TextureTypes::HeightmapOverlay, path, data);
       }
       zip_entry_close(zip);
 
@@ -103,7 +113,7 @@ bool Project::load(QString project_path, QList<ImageProcessor *> *p_list, QJsonO
       {
         zip_entry_read(zip, &buf, &bufsize);
         data.append((char *)buf, bufsize);
-        p->set_occlussion_overlay(QImage::fromData(data));
+        restore_overlay(p, TextureTypes::OcclussionOverlay, path, data);
       }
       zip_entry_close(zip);
 
@@ -113,7 +123,7 @@ bool Project::load(QString project_path, QList<ImageProcessor *> *p_list, QJsonO
       {
         zip_entry_read(zip, &buf, &bufsize);
         data.append((char *)buf, bufsize);
-        p->set_parallax_overlay(QImage::fromData(data));
+        restore_overlay(p, TextureTypes::ParallaxOverlay, path, data);
       }
       zip_entry_close(zip);
 
@@ -123,7 +133,7 @@ bool Project::load(QString project_path, QList<ImageProcessor *> *p_list, QJsonO
       {
         zip_entry_read(zip, &buf, &bufsize);
         data.append((char *)buf, bufsize);
-        p->set_specular_overlay(QImage::fromData(data));
+        restore_overlay(p, TextureTypes::SpecularOverlay, path, data);
       }
       zip_entry_close(zip);
 
@@ -213,7 +223,7 @@ bool Project::load(QString project_path, QList<ImageProcessor *> *p_list, QJsonO
       {
         zip_entry_read(zip, &buf, &bufsize);
         data.append((char *)buf, bufsize);
-        p->get_current_frame()->set_image(TextureTypes::Neighbours, QImage::fromData(data));
+        p->set_neighbours_canvas(QImage::fromData(data));
       }
       zip_entry_close(zip);
 
@@ -249,6 +259,11 @@ bool Project::save(QString path, QList<ImageProcessor *> processorList, QJsonObj
     {
       QImage texture;
       s.get_image((TextureTypes)i, &texture);
+      if ((TextureTypes)i == TextureTypes::Neighbours)
+      {
+        /* Only kept as a description, the file has the old canvas */
+        texture = p->get_neighbours_canvas();
+      }
       bool save = true;
       switch ((TextureTypes)i)
       {
@@ -0,0 +1,189 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "recompute_scheduler.h"
+#include "cancellation.h"
+#include "image_processor.h"
+#include "memory_accountant.h"
+#include "worker_pool.h"
+
+#include <QCoreApplication>
+
+RecomputeScheduler &RecomputeScheduler::instance()
+{
+  static RecomputeScheduler scheduler;
+  return scheduler;
+}
+
+RecomputeScheduler::RecomputeScheduler()
+{
+  /* dispatch() runs from the main event loop */
+  if (QCoreApplication::instance())
+  {
+    moveToThread(QCoreApplication::instance()->thread());
+  }
+}
+
+void RecomputeScheduler::request(ImageProcessor *processor, ProcessedImage map, QRect rect)
+{
+  const bool full = rect == QRect(0, 0, 0, 0);
+  QMutexLocker locker(&mutex);
+  Job &job = jobs[JobKey(processor, static_cast<int>(map))];
+
+  if (!job.pending)
+  {
+    job.rect = rect;
+  }
+  else if (job.rect != QRect(0, 0, 0, 0))
+  {
+    job.rect = full ? rect : job.rect.united(rect);
+  }
+  job.pending = true;
+
+  if (full && job.running)
+  {
+    job.cancel->store(true);
+  }
+
+  if (!dispatch_posted)
+  {
+    dispatch_posted = true;
+    QMetaObject::invokeMethod(this, "dispatch", Qt::QueuedConnection);
+  }
+}
+
+void RecomputeScheduler::forget(ImageProcessor *processor)
+{
+  QMutexLocker locker(&mutex);
+  for (;;)
+  {
+    bool running = false;
+    for (auto it = jobs.begin(); it != jobs.end();)
+    {
+      if (it.key().first != processor)
+      {
+        ++it;
+        continue;
+      }
+      it->pending = false;
+      if (it->running)
+      {
+        it->cancel->store(true);
+        running = true;
+        ++it;
+      }
+      else
+      {
+        it = jobs.erase(it);
+      }
+    }
+    if (!running)
+      return;
+    stopped.wait(&mutex);
+  }
+}
+
+void RecomputeScheduler::dispatch()
+{
+  QMutexLocker locker(&mutex);
+  dispatch_posted = false;
+  for (auto it = jobs.begin(); it != jobs.end(); ++it)
+  {
+    if (!it->pending || it->running)
+      continue;
+
+    it->pending = false;
+    it->running = true;
+    it->cancel = std::make_shared<std::atomic<bool>>(false);
+
+    const JobKey key = it.key();
+    const QRect rect = it->rect;
+    std::shared_ptr<std::atomic<bool>> cancel = it->cancel;
+    WorkerPool::instance().submit(Priority::Interactive, [this, key, rect, cancel]() {
+      {
+        CancelScope scope(cancel.get());
+        run(key, rect);
+      }
+      finish(key);
+    });
+  }
+}
+
+void RecomputeScheduler::run(const JobKey &key, QRect rect)
+{
+  ImageProcessor *processor = key.first;
+  const ProcessedImage map = static_cast<ProcessedImage>(key.second);
+  MemoryAccountant::instance().touch(processor);
+  /* Jobs start as interactive: previews and brush strokes. Full resolution
+   * maps make way for those of other jobs. */
+  Priority priority = Priority::Interactive;
+  if (rect == QRect(0, 0, 0, 0))
+  {
+    processor->publish_previews(map);
+    if (cancelled())
+      return;
+    priority = Priority::Background;
+  }
+  PriorityScope scope(priority);
+
+  switch (map)
+  {
+    case ProcessedImage::Normal:
+      processor->generate_normal_map(rect);
+      break;
+    case ProcessedImage::Parallax:
+      processor->calculate_parallax();
+      break;
+    case ProcessedImage::Specular:
+      processor->calculate_specular();
+      break;
+    case ProcessedImage::Occlusion:
+      processor->calculate_occlusion();
+      break;
+    default:
+      break;
+  }
+}
+
+void RecomputeScheduler::finish(const JobKey &key)
+{
+  {
+    QMutexLocker locker(&mutex);
+    auto it = jobs.find(key);
+    if (it == jobs.end())
+      return;
+
+    it->running = false;
+    if (it->pending)
+    {
+      if (!dispatch_posted)
+      {
+        dispatch_posted = true;
+        QMetaObject::invokeMethod(this, "dispatch", Qt::QueuedConnection);
+      }
+    }
+    else
+    {
+      jobs.erase(it);
+    }
+    stopped.wakeAll();
+  }
+  /* The run may have left more intermediates than the budget allows */
+  MemoryAccountant::instance().enforce();
+}
@@ -0,0 +1,86 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef RECOMPUTESCHEDULER_H
+#define RECOMPUTESCHEDULER_H
+
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QPair>
+#include <QRect>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <memory>
+
+class ImageProcessor;
+enum class ProcessedImage;
+
+/* Schedules the map recomputations of every processor, instead of a polling
+ * timer per processor.
+ *
+ * Requests for the same map of the same processor coalesce: while one is
+ * waiting, later ones only widen its area. A full request supersedes the
+ * running computation of that map, which is cancelled at its next tile
+ * boundary (see cancellation.h) and started again, so only the latest
+ * parameters are ever finished. Rect requests, as brush strokes send, let
+ * the running one finish and follow it. Full requests publish downscaled
+ * previews before the full resolution map, see
+ * ImageProcessor::publish_previews.
+ *
+ * A map of a processor is never computed twice at once; different maps and
+ * processors run in parallel on the global thread pool. Requests are
+ * dispatched from the event loop, so a burst of them costs one run. */
+class RecomputeScheduler : public QObject
+{
+  Q_OBJECT
+
+public:
+  static RecomputeScheduler &instance();
+
+  /* Recomputes rect of map, or all of it for QRect(0, 0, 0, 0) */
+  void request(ImageProcessor *processor, ProcessedImage map, QRect rect = QRect(0, 0, 0, 0));
+  /* Drops the requests of processor, cancels its running computations and
+   * waits for them to stop */
+  void forget(ImageProcessor *processor);
+
+private slots:
+  void dispatch();
+
+private:
+  RecomputeScheduler();
+  typedef QPair<ImageProcessor *, int> JobKey;
+  void run(const JobKey &key, QRect rect);
+  void finish(const JobKey &key);
+
+  struct Job
+  {
+    bool pending = false;
+    bool running = false;
+    QRect rect;
+    std::shared_ptr<std::atomic<bool>> cancel;
+  };
+  QMutex mutex;
+  QWaitCondition stopped;
+  QHash<JobKey, Job> jobs;
+  bool dispatch_posted = false;
+};
+
+#endif // RECOMPUTESCHEDULER_H
@@ -0,0 +1,95 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "scratch_memory.h"
+
+#include <QDir>
+#include <QTemporaryFile>
+
+#include <atomic>
+
+static qint64 initial_budget()
+{
+  return qEnvironmentVariableIntValue("LAIGTER_MEMORY_BUDGET") * Q_INT64_C(1048576);
+}
+
+static std::atomic<qint64> budget(initial_budget());
+static std::atomic<qint64> resident(0);
+
+void set_memory_budget(qint64 bytes) { budget = bytes > 0 ? bytes : 0; }
+
+qint64 memory_budget() { return budget; }
+
+bool tiled_processing() { return budget > 0; }
+
+/* Owns the bytes of a scratch buffer, in RAM or in a mapped file */
+class ScratchStorage
+{
+public:
+  explicit ScratchStorage(qint64 bytes) : bytes(bytes)
+  {
+    qint64 limit = budget;
+    qint64 held = resident.fetch_add(bytes) + bytes;
+    if (limit == 0 || held <= limit)
+    {
+      ram.reset(new float[(bytes + 3) / 4]);
+      data = ram.get();
+      return;
+    }
+    resident -= bytes;
+
+    file.setFileTemplate(QDir::tempPath() + "/laigter_XXXXXX.scratch");
+    if (file.open() && file.resize(bytes))
+    {
+      data = reinterpret_cast<float *>(file.map(0, bytes));
+    }
+    if (!data)
+    {
+      /* No room on disk either, going over the budget beats failing */
+      resident += bytes;
+      ram.reset(new float[(bytes + 3) / 4]);
+      data = ram.get();
+    }
+  }
+
+  ~ScratchStorage()
+  {
+    if (ram)
+      resident -= bytes;
+    else
+      file.unmap(reinterpret_cast<uchar *>(data));
+  }
+
+  float *data = nullptr;
+
+private:
+  qint64 bytes;
+  std::unique_ptr<float[]> ram;
+  QTemporaryFile file;
+};
+
+std::shared_ptr<void> scratch_buffer(qint64 bytes)
+{
+  if (bytes <= 0)
+    return std::shared_ptr<void>();
+
+  auto storage = std::make_shared<ScratchStorage>(bytes);
+  /* The storage lives as long as the pointer */
+  return std::shared_ptr<void>(storage, storage->data);
+}
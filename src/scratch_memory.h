@@ -0,0 +1,43 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef SCRATCHMEMORY_H
+#define SCRATCHMEMORY_H
+
+#include <QtGlobal>
+
+#include <memory>
+
+/* Memory budget of the processing buffers, in bytes, 0 for none. It starts
+ * from the LAIGTER_MEMORY_BUDGET environment variable (MiB), the CLI can
+ * set it with --memory-budget. The intermediates processors keep between
+ * runs are held to it too, see MemoryAccountant. */
+void set_memory_budget(qint64 bytes);
+qint64 memory_budget();
+
+/* With a budget, stages work in tiles of this side plus their halo, so
+ * their temporaries stay small whatever the sprite size. */
+const int budget_tile_side = 1024;
+bool tiled_processing();
+
+/* Uninitialized buffer held in RAM while the budget allows it, and in a
+ * memory mapped scratch file past it, where the OS pages it in and out. */
+std::shared_ptr<void> scratch_buffer(qint64 bytes);
+
+#endif // SCRATCHMEMORY_H
@@ -1,8 +1,32 @@
 #include "sprite.h"
 
+bool is_overlay(TextureTypes type)
+{
+  return type >= TextureTypes::TextureOverlay && type <= TextureTypes::OcclussionOverlay;
+}
+
+int overlay_channels(TextureTypes type)
+{
+  return type >= TextureTypes::HeightmapOverlay && type <= TextureTypes::OcclussionOverlay ? 2 : 4;
+}
+
+/* Slots loadImage fills with the same image, and that processors of the
+ * same file hold alike */
+static bool is_source(TextureTypes type)
+{
+  return type == TextureTypes::Diffuse || type == TextureTypes::Heightmap ||
+         type == TextureTypes::SpecularBase || type == TextureTypes::OcclussionBase;
+}
+
 Sprite::Sprite()
 {
   textures.resize(17);
+  for (int t = 0; t < textures.size(); t++)
+  {
+    textures[t].set_sparse(is_overlay(static_cast<TextureTypes>(t)),
+                           overlay_channels(static_cast<TextureTypes>(t)));
+    textures[t].set_shared(is_source(static_cast<TextureTypes>(t)));
+  }
   neighbours_paths.resize(3);
   neighbours_paths[0].resize(3);
   neighbours_paths[1].resize(3);
@@ -46,12 +70,70 @@ bool Sprite::get_image(TextureTypes type, QImage *dst)
   return textures[t].get_image(dst);
 }
 
+PlanarImage Sprite::get_planar(TextureTypes type, QImage::Format format)
+{
+  int t = static_cast<int>(type);
+  return textures[t].get_planar(format);
+}
+
+qint64 Sprite::cache_key(TextureTypes type)
+{
+  int t = static_cast<int>(type);
+  return textures[t].cache_key();
+}
+
+TiledOverlay Sprite::get_overlay(TextureTypes type)
+{
+  int t = static_cast<int>(type);
+  return textures[t].tiles();
+}
+
+void Sprite::set_overlay(TextureTypes type, TiledOverlay overlay)
+{
+  int t = static_cast<int>(type);
+  textures[t].set_tiles(overlay);
+}
+
 void Sprite::set_texture(TextureTypes type, Texture t)
 {
   int tex = static_cast<int>(type);
-  textures[tex].lock();
   textures[tex] = t;
-  textures[tex].unlock();
+}
+
+/* Whether an earlier slot than t holds the pixels of t */
+bool Sprite::shared_before(int t)
+{
+  for (int u = 0; u < t; u++)
+  {
+    if (textures[u].shares_pixels(textures[t]))
+      return true;
+  }
+  return false;
+}
+
+qint64 Sprite::bytes(TextureTypes type)
+{
+  int t = static_cast<int>(type);
+  return shared_before(t) ? 0 : textures[t].bytes();
+}
+
+qint64 Sprite::planes_bytes()
+{
+  qint64 total = 0;
+  for (int t = 0; t < textures.size(); t++)
+  {
+    if (!shared_before(t))
+      total += textures[t].planes_bytes();
+  }
+  return total;
+}
+
+void Sprite::release_planes()
+{
+  for (int t = 0; t < textures.size(); t++)
+  {
+    textures[t].release_planes();
+  }
 }
 
 QSize Sprite::size() { return textures[0].size(); }
@@ -26,6 +26,11 @@ enum class TextureTypes
   OcclussionOverlay
 };
 
+bool is_overlay(TextureTypes type);
+/* Channels of the overlay tiles: value and alpha for the overlays of gray
+ * maps, RGBA for the others */
+int overlay_channels(TextureTypes type);
+
 class Sprite
 {
 public:
@@ -36,13 +41,24 @@ public:
 
 private:
   QVector<Texture> textures;
+  bool shared_before(int t);
 
 public:
   explicit Sprite();
   explicit Sprite(const Sprite &S);
   void set_image(TextureTypes type, QImage i);
   bool get_image(TextureTypes type, QImage *dst);
+  PlanarImage get_planar(TextureTypes type, QImage::Format format = QImage::Format_Invalid);
+  qint64 cache_key(TextureTypes type);
+  /* Painted tiles of a brush overlay, which are stored sparse */
+  TiledOverlay get_overlay(TextureTypes type);
+  void set_overlay(TextureTypes type, TiledOverlay overlay);
   void set_texture(TextureTypes type, Texture t);
+  /* Bytes of a texture, 0 when an earlier slot holds the same pixels */
+  qint64 bytes(TextureTypes type);
+  /* Planar conversions of all the textures, see Texture::release_planes */
+  qint64 planes_bytes();
+  void release_planes();
   Sprite &operator=(const Sprite &S);
   QString get_file_name();
   QSize size();
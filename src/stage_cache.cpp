@@ -0,0 +1,153 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "stage_cache.h"
+#include "cancellation.h"
+
+#include <cstring>
+
+using namespace cimg_library;
+
+/* splitmix64 finalizer */
+static quint64 mix(quint64 x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+StageKey::StageKey(int node) : m_node(node), m_value(mix(node)) {}
+
+StageKey &StageKey::operator<<(quint64 v)
+{
+  m_value = mix(m_value ^ mix(v));
+  return *this;
+}
+
+StageKey &StageKey::operator<<(qint64 v) { return *this << static_cast<quint64>(v); }
+
+StageKey &StageKey::operator<<(int v) { return *this << static_cast<quint64>(static_cast<qint64>(v)); }
+
+StageKey &StageKey::operator<<(bool v) { return *this << static_cast<quint64>(v); }
+
+StageKey &StageKey::operator<<(double v)
+{
+  quint64 bits;
+  memcpy(&bits, &v, sizeof(bits));
+  return *this << bits;
+}
+
+int StageKey::node() const { return m_node; }
+
+quint64 StageKey::value() const { return m_value; }
+
+StageCache::StageCache(int per_node) : per_node(per_node) {}
+
+StageImage StageCache::get(const StageKey &key, const std::function<StageImage()> &compute)
+{
+  const QPair<int, quint64> id(key.node(), key.value());
+  {
+    QMutexLocker locker(&mutex);
+    StageImage image = lookup(key.node(), key.value());
+    while (!image && running.contains(id))
+    {
+      computed.wait(&mutex);
+      image = lookup(key.node(), key.value());
+    }
+    if (image)
+      return image;
+    running.append(id);
+  }
+
+  StageImage image = compute();
+
+  QMutexLocker locker(&mutex);
+  running.removeOne(id);
+  computed.wakeAll();
+  /* A cancelled computation may be incomplete, it is only good for the
+   * cancelled job itself. Threads waiting for it compute their own. */
+  if (cancelled())
+    return image;
+
+  store(key.node(), key.value(), image);
+  return lookup(key.node(), key.value());
+}
+
+StageImage StageCache::find(const StageKey &key)
+{
+  QMutexLocker locker(&mutex);
+  return lookup(key.node(), key.value());
+}
+
+/* Called with mutex held */
+StageImage StageCache::lookup(int node, quint64 key)
+{
+  for (int i = 0; i < entries.size(); i++)
+  {
+    if (entries[i].node == node && entries[i].key == key)
+    {
+      entries.move(i, 0);
+      return entries[0].image;
+    }
+  }
+  return StageImage();
+}
+
+void StageCache::insert(const StageKey &key, StageImage image)
+{
+  QMutexLocker locker(&mutex);
+  store(key.node(), key.value(), image);
+}
+
+/* Called with mutex held */
+void StageCache::store(int node, quint64 key, StageImage image)
+{
+  /* Another thread computed the same output meanwhile, keep the first */
+  for (const Entry &e : entries)
+  {
+    if (e.node == node && e.key == key)
+      return;
+  }
+
+  int kept = 0;
+  for (int i = 0; i < entries.size(); i++)
+  {
+    if (entries[i].node == node && ++kept >= per_node)
+      entries.removeAt(i--);
+  }
+  entries.prepend({node, key, image});
+}
+
+void StageCache::clear()
+{
+  QMutexLocker locker(&mutex);
+  entries.clear();
+}
+
+QList<StageImage> StageCache::images()
+{
+  QMutexLocker locker(&mutex);
+  QList<StageImage> images;
+  for (const Entry &entry : entries)
+  {
+    images.append(entry.image);
+  }
+  return images;
+}
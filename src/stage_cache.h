@@ -0,0 +1,96 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef STAGECACHE_H
+#define STAGECACHE_H
+
+#include "src/compact_image.h"
+
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QWaitCondition>
+
+#include <functional>
+#include <memory>
+
+/* Output of a processing stage. Outputs are shared by the cache and every
+ * stage reading them, so they are never modified once published. */
+typedef std::shared_ptr<const CompactImage> StageImage;
+
+/* Hash of everything a stage output depends on: the node, the keys of its
+ * inputs and its parameters. Equal keys mean equal outputs. */
+class StageKey
+{
+public:
+  explicit StageKey(int node);
+  StageKey &operator<<(quint64 v);
+  StageKey &operator<<(qint64 v);
+  StageKey &operator<<(int v);
+  StageKey &operator<<(bool v);
+  StageKey &operator<<(double v);
+
+  int node() const;
+  quint64 value() const;
+
+private:
+  int m_node;
+  quint64 m_value;
+};
+
+/* Memoized stage outputs. Each node keeps its most recent outputs, so
+ * moving a slider back and forth, or switching a mode on and off, finds
+ * the earlier output instead of recomputing it. */
+class StageCache
+{
+public:
+  explicit StageCache(int per_node = 2);
+
+  /* Cached output for key, computing and storing it when missing. compute
+   * runs without the cache locked, so independent stages don't wait for
+   * each other. A key that another thread is computing already is waited
+   * for instead, so map branches sharing a node compute it once. */
+  StageImage get(const StageKey &key, const std::function<StageImage()> &compute);
+  StageImage find(const StageKey &key);
+  void insert(const StageKey &key, StageImage image);
+  void clear();
+  /* Outputs held, for the memory accounting */
+  QList<StageImage> images();
+
+private:
+  struct Entry
+  {
+    int node;
+    quint64 key;
+    StageImage image;
+  };
+
+  StageImage lookup(int node, quint64 key);
+  void store(int node, quint64 key, StageImage image);
+
+  QMutex mutex;
+  /* Most recently used first */
+  QList<Entry> entries;
+  /* Node and key of the outputs being computed */
+  QList<QPair<int, quint64>> running;
+  QWaitCondition computed;
+  int per_node;
+};
+
+#endif // STAGECACHE_H
@@ -1,48 +1,291 @@
 #include "texture.h"
+#include "frame_layout.h"
 
-Texture::Texture(QObject *parent) : QObject(parent) {}
+#include <QHash>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+/* Versions are unique across textures, so a snapshot moved to another
+ * texture by assignment still differs from whatever that texture held. */
+static std::atomic<quint64> next_version(1);
+
+static std::shared_ptr<const TexturePixels> own_pixels(const QImage &image)
+{
+  std::shared_ptr<TexturePixels> p = std::make_shared<TexturePixels>();
+  p->image = image;
+  return p;
+}
+
+/* Pixels of the shared textures by content hash, and by the cache key of
+ * the images already looked up, so an image set on several slots is only
+ * hashed once. Entries go with the last snapshot holding them. */
+static QMutex pool_mutex;
+static QHash<quint64, std::weak_ptr<const TexturePixels>> pool_by_hash;
+static QHash<qint64, std::weak_ptr<const TexturePixels>> pool_by_key;
+static qsizetype pool_mark = 64;
+
+static int row_bytes(const QImage &image) { return (image.width() * image.depth() + 7) / 8; }
+
+static quint64 content_hash(const QImage &image)
+{
+  quint64 h = static_cast<quint64>(image.format()) << 48 ^ static_cast<quint64>(image.width()) << 24 ^
+              static_cast<quint64>(image.height());
+  for (int y = 0; y < image.height(); y++)
+  {
+    h = hash_bytes(image.constScanLine(y), row_bytes(image), h);
+  }
+  /* 0 stands for not shared */
+  return h | 1;
+}
+
+static bool same_pixels(const QImage &a, const QImage &b)
+{
+  if (a.format() != b.format() || a.size() != b.size())
+    return false;
+  for (int y = 0; y < a.height(); y++)
+  {
+    if (memcmp(a.constScanLine(y), b.constScanLine(y), row_bytes(a)) != 0)
+      return false;
+  }
+  return true;
+}
+
+/* Drops the entries of pixels no snapshot holds anymore, once there are
+ * twice as many as after the previous sweep. Needs pool_mutex. */
+static void sweep_pool()
+{
+  if (pool_by_key.size() + pool_by_hash.size() < 2 * pool_mark)
+    return;
+  for (auto it = pool_by_key.begin(); it != pool_by_key.end();)
+  {
+    if (it->expired())
+      it = pool_by_key.erase(it);
+    else
+      ++it;
+  }
+  for (auto it = pool_by_hash.begin(); it != pool_by_hash.end();)
+  {
+    if (it->expired())
+      it = pool_by_hash.erase(it);
+    else
+      ++it;
+  }
+  pool_mark = std::max<qsizetype>(64, pool_by_key.size() + pool_by_hash.size());
+}
+
+static std::shared_ptr<const TexturePixels> shared_pixels(const QImage &image)
+{
+  if (image.isNull())
+    return own_pixels(image);
+
+  std::shared_ptr<const TexturePixels> found;
+  {
+    QMutexLocker locker(&pool_mutex);
+    found = pool_by_key.value(image.cacheKey()).lock();
+  }
+  if (found)
+    return found;
+
+  /* Hashed and compared outside the lock, textures being set elsewhere
+   * don't wait for a big image */
+  const quint64 hash = content_hash(image);
+  {
+    QMutexLocker locker(&pool_mutex);
+    found = pool_by_hash.value(hash).lock();
+  }
+  if (!found || !same_pixels(found->image, image))
+  {
+    std::shared_ptr<TexturePixels> p = std::make_shared<TexturePixels>();
+    p->image = image;
+    p->hash = hash;
+    found = p;
+  }
+
+  QMutexLocker locker(&pool_mutex);
+  /* A collision replaces the older entry, which just stops being found */
+  pool_by_hash.insert(hash, found);
+  pool_by_key.insert(image.cacheKey(), found);
+  sweep_pool();
+  return found;
+}
+
+static std::shared_ptr<const TextureSnapshot> make_snapshot(std::shared_ptr<const TexturePixels> pixels,
+                                                            const TiledOverlay &tiles = TiledOverlay())
+{
+  std::shared_ptr<TextureSnapshot> s = std::make_shared<TextureSnapshot>();
+  s->image = pixels->image;
+  s->tiles = tiles;
+  s->version = next_version++;
+  s->pixels = pixels;
+  return s;
+}
+
+Texture::Texture(QObject *parent) : QObject(parent), current(make_snapshot(own_pixels(QImage()))) {}
 
 Texture::Texture(const Texture &T)
+    : QObject(nullptr), current(T.snapshot()), type(T.type), sparse(T.sparse), channels(T.channels),
+      shared(T.shared)
 {
-  image = T.image;
-  type = T.type;
 }
 
 Texture &Texture::operator=(const Texture &T)
 {
-  image = T.image;
+  publish(T.snapshot());
   type = T.type;
+  sparse = T.sparse;
+  channels = T.channels;
+  shared = T.shared;
   return *this;
 }
 
+std::shared_ptr<const TextureSnapshot> Texture::snapshot() const
+{
+  return std::atomic_load(&current);
+}
+
+void Texture::publish(std::shared_ptr<const TextureSnapshot> s)
+{
+  std::atomic_store(&current, s);
+}
+
 bool Texture::set_image(QImage i)
 {
-  if (mutex.tryLock())
+  if (sparse)
   {
-         image = i.copy();
-    mutex.unlock();
+    /* Unchanged tiles stay shared with the previous version */
+    publish(make_snapshot(own_pixels(QImage()), TiledOverlay::from_image(i, snapshot()->tiles, channels)));
     return true;
   }
-  return false;
+  /* QImage is implicitly shared: the snapshot keeps the caller's pixels, or
+   * equal ones it found, and a later write on either side detaches, so no
+   * copy is made here. */
+  publish(make_snapshot(shared ? shared_pixels(i) : own_pixels(i)));
+  return true;
 }
 
 bool Texture::get_image(QImage *dst)
 {
-  if (mutex.tryLock())
-  {
-    *dst = image.copy();
-    mutex.unlock();
+  std::shared_ptr<const TextureSnapshot> s = snapshot();
+  *dst = sparse ? s->tiles.to_image() : s->image;
+  return true;
+}
+
+void Texture::set_sparse(bool s, int c)
+{
+  if (s == sparse && c == channels)
+    return;
+  QImage image;
+  get_image(&image);
+  sparse = s;
+  channels = c;
+  set_image(image);
+}
+
+bool Texture::is_sparse() const { return sparse; }
+
+void Texture::set_shared(bool s)
+{
+  if (s == shared)
+    return;
+  shared = s;
+  if (!sparse)
+    set_image(snapshot()->image);
+}
+
+bool Texture::shares_pixels(const Texture &other) const
+{
+  std::shared_ptr<const TextureSnapshot> a = snapshot(), b = other.snapshot();
+  if (a->pixels == b->pixels)
     return true;
+  return !a->image.isNull() && a->image.cacheKey() == b->image.cacheKey();
+}
+
+void Texture::set_tiles(TiledOverlay t)
+{
+  if (sparse && t.channels() != channels)
+  {
+    /* Blank overlays are made of the right kind, only others are converted */
+    t = t.is_empty() ? TiledOverlay(t.size(), channels)
+                     : TiledOverlay::from_image(t.to_image(), snapshot()->tiles, channels);
   }
-  return false;
+  if (sparse)
+    publish(make_snapshot(own_pixels(QImage()), t));
+  else
+    set_image(t.to_image());
 }
 
-void Texture::set_type(QString t) { type = t; }
+TiledOverlay Texture::tiles() const
+{
+  std::shared_ptr<const TextureSnapshot> s = snapshot();
+  return sparse ? s->tiles : TiledOverlay::from_image(s->image);
+}
 
-QString Texture::get_type() { return type; }
+PlanarImage Texture::get_planar(QImage::Format format)
+{
+  std::shared_ptr<const TextureSnapshot> s = snapshot();
+  if (s->image.isNull() && s->tiles.size().isEmpty())
+    return PlanarImage();
 
-void Texture::lock() { mutex.lock(); }
+  {
+    QMutexLocker locker(&s->pixels->planes_mutex);
+    PlanarImage cached = s->pixels->planes.value(format);
+    if (!cached.is_empty())
+      return cached;
+  }
 
-void Texture::unlock() { mutex.unlock(); }
+  /* Convert outside the lock, readers of other formats are not held up
+   * while a big texture is being transposed. */
+  QImage source = sparse ? s->tiles.to_image() : s->image;
+  if (format != QImage::Format_Invalid && source.format() != format)
+    source = source.convertToFormat(format);
+  PlanarImage p = PlanarImage::from_qimage(source);
 
-QSize Texture::size() { return image.size(); }
+  QMutexLocker locker(&s->pixels->planes_mutex);
+  s->pixels->planes.insert(format, p);
+  return p;
+}
+
+qint64 Texture::cache_key()
+{
+  /* Sparse textures have no QImage, versions change with every set_image */
+  std::shared_ptr<const TextureSnapshot> s = snapshot();
+  return sparse ? static_cast<qint64>(s->version) : s->image.cacheKey();
+}
+
+qint64 Texture::bytes()
+{
+  std::shared_ptr<const TextureSnapshot> s = snapshot();
+  return s->image.sizeInBytes() + s->tiles.bytes();
+}
+
+qint64 Texture::planes_bytes()
+{
+  std::shared_ptr<const TextureSnapshot> s = snapshot();
+  QMutexLocker locker(&s->pixels->planes_mutex);
+  qint64 total = 0;
+  for (const PlanarImage &p : s->pixels->planes)
+  {
+    total += qint64(p.width()) * p.height() * p.channels();
+  }
+  return total;
+}
+
+/* Readers keep the planes they got, copies share the pixels */
+void Texture::release_planes()
+{
+  std::shared_ptr<const TextureSnapshot> s = snapshot();
+  QMutexLocker locker(&s->pixels->planes_mutex);
+  s->pixels->planes.clear();
+}
+
+void Texture::set_type(QString t) { type = t; }
+
+QString Texture::get_type() { return type; }
+
+QSize Texture::size()
+{
+  std::shared_ptr<const TextureSnapshot> s = snapshot();
+  return sparse ? s->tiles.size() : s->image.size();
+}
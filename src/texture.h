@@ -1,10 +1,43 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include "src/planar_image.h"
+#include "src/tiled_overlay.h"
+
 #include <QImage>
+#include <QMap>
 #include <QMutex>
 #include <QObject>
 
+#include <memory>
+
+/* Pixels of a texture and the planar conversions made of them. Shared
+ * textures with equal content use one, see Texture::set_shared. Only the
+ * planar conversions are filled in lazily, under their own mutex. */
+struct TexturePixels
+{
+  QImage image;
+  /* Content hash, 0 when not shared */
+  quint64 hash = 0;
+
+  mutable QMutex planes_mutex;
+  /* Planar decompositions of image, keyed by the requested format */
+  mutable QMap<int, PlanarImage> planes;
+};
+
+/* One published version of a texture. Snapshots never change once they are
+ * published: a new image makes a new snapshot, so readers holding the old
+ * one keep a complete, consistent picture for as long as they need it. */
+struct TextureSnapshot
+{
+  QImage image;
+  /* Pixels of a sparse texture, image is null then */
+  TiledOverlay tiles;
+  quint64 version = 0;
+  /* Never null */
+  std::shared_ptr<const TexturePixels> pixels;
+};
+
 class Texture : public QObject
 {
   Q_OBJECT
@@ -17,16 +50,43 @@ public:
 public slots:
   bool set_image(QImage i);
   bool get_image(QImage *dst);
+  PlanarImage get_planar(QImage::Format format = QImage::Format_Invalid);
+  /* Identifies the stored pixels: equal keys mean equal content. */
+  qint64 cache_key();
+  /* Bytes of the pixels, and of the planar conversions made of them */
+  qint64 bytes();
+  qint64 planes_bytes();
+  /* Drops the planar conversions, get_planar makes them again */
+  void release_planes();
   void set_type(QString t);
-  void lock();
-  void unlock();
   QSize size();
   QString get_type();
 
+public:
+  /* Sparse textures keep their pixels as a TiledOverlay: set_image stores
+   * only the painted tiles, get_image and get_planar assemble them. The
+   * tiles have channels channels, see TiledOverlay. */
+  void set_sparse(bool s, int channels = 4);
+  bool is_sparse() const;
+  /* Shared textures look their images up by content: the slots and
+   * processors holding equal pixels keep one copy of them and of their
+   * planar conversions. A texture only gets pixels of its own when it is
+   * set to different ones, QImage detaches writers on its own. */
+  void set_shared(bool s);
+  /* Whether both hold the same pixels, not just equal ones */
+  bool shares_pixels(const Texture &other) const;
+  void set_tiles(TiledOverlay t);
+  TiledOverlay tiles() const;
+  /* Latest published version. Never null, never blocks on writers. */
+  std::shared_ptr<const TextureSnapshot> snapshot() const;
+  void publish(std::shared_ptr<const TextureSnapshot> s);
+
 private:
-  QMutex mutex;
-  QImage image;
+  std::shared_ptr<const TextureSnapshot> current;
   QString type;
+  bool sparse = false;
+  int channels = 4;
+  bool shared = false;
 };
 
 #endif // TEXTURE_H
@@ -0,0 +1,318 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "tiled_overlay.h"
+#include "frame_layout.h"
+#include "worker_pool.h"
+
+#include <QDataStream>
+#include <QPainter>
+
+#include <algorithm>
+#include <cstring>
+
+static bool all_zero(const uchar *data, int count)
+{
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    quint64 word;
+    memcpy(&word, data + i, 8);
+    if (word)
+      return false;
+  }
+  for (; i < count; i++)
+  {
+    if (data[i])
+      return false;
+  }
+  return true;
+}
+
+TiledOverlay::TiledOverlay() {}
+
+TiledOverlay::TiledOverlay(QSize size, int channels)
+    : m_size(size.isValid() ? size : QSize()), m_channels(channels == 2 ? 2 : 4),
+      m_columns((m_size.width() + tile_side - 1) / tile_side),
+      m_rows((m_size.height() + tile_side - 1) / tile_side),
+      m_tiles(m_columns * m_rows),
+      m_hashes(m_columns * m_rows, 0)
+{
+}
+
+/* count premultiplied RGBA pixels to channels bytes each, value and alpha
+ * when there are 2. Value is the red channel, the only one gray maps read. */
+static void pack_row(const uchar *src, int count, int channels, uchar *dst)
+{
+  if (channels == 4)
+  {
+    memcpy(dst, src, 4 * count);
+    return;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    dst[2 * i] = src[4 * i];
+    dst[2 * i + 1] = src[4 * i + 3];
+  }
+}
+
+static void unpack_row(const uchar *src, int count, int channels, uchar *dst)
+{
+  if (channels == 4)
+  {
+    memcpy(dst, src, 4 * count);
+    return;
+  }
+  for (int i = 0; i < count; i++)
+  {
+    dst[4 * i] = dst[4 * i + 1] = dst[4 * i + 2] = src[2 * i];
+    dst[4 * i + 3] = src[2 * i + 1];
+  }
+}
+
+TiledOverlay TiledOverlay::from_image(const QImage &image, const TiledOverlay &previous, int channels)
+{
+  TiledOverlay ov(image.size(), channels);
+  if (image.isNull())
+    return ov;
+
+  QImage src = image;
+  if (src.format() != QImage::Format_RGBA8888_Premultiplied)
+  {
+    src = src.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
+  }
+  const uchar *bits = src.constBits();
+  const int stride = src.bytesPerLine();
+  const bool reuse = previous.m_size == ov.m_size && previous.m_channels == ov.m_channels;
+
+  /* Detach before the workers write to them */
+  QByteArray *tiles = ov.m_tiles.data();
+  quint64 *hashes = ov.m_hashes.data();
+  parallel_for(ov.m_tiles.size(), ov.m_tiles.size() > 1, [&](int i) {
+    const QRect r = ov.tile_rect(i % ov.m_columns, i / ov.m_columns);
+    bool empty = true;
+    for (int y = r.top(); y <= r.bottom() && empty; y++)
+    {
+      empty = all_zero(bits + y * stride + 4 * r.left(), 4 * r.width());
+    }
+    if (empty)
+      return;
+
+    const int row_bytes = ov.m_channels * r.width();
+    QByteArray tile(row_bytes * r.height(), Qt::Uninitialized);
+    uchar *dst = reinterpret_cast<uchar *>(tile.data());
+    quint64 h = static_cast<quint64>(r.width()) << 32 | static_cast<quint32>(r.height());
+    for (int y = r.top(); y <= r.bottom(); y++)
+    {
+      uchar *row = dst + (y - r.top()) * row_bytes;
+      pack_row(bits + y * stride + 4 * r.left(), r.width(), ov.m_channels, row);
+      h = hash_bytes(row, row_bytes, h);
+    }
+    /* 0 stands for unpainted */
+    hashes[i] = h | 1;
+
+    const QByteArray &old = previous.m_tiles.value(i);
+    if (reuse && !old.isNull() && previous.m_hashes[i] == hashes[i] && old == tile)
+      tiles[i] = old;
+    else
+      tiles[i] = tile;
+  });
+
+  for (const QByteArray &tile : ov.m_tiles)
+  {
+    ov.m_painted += !tile.isNull();
+  }
+  return ov;
+}
+
+QImage TiledOverlay::to_image() const
+{
+  if (m_size.isEmpty())
+    return QImage();
+
+  QImage image(m_size, QImage::Format_RGBA8888_Premultiplied);
+  image.fill(0);
+  uchar *bits = image.bits();
+  const int stride = image.bytesPerLine();
+  for (int i = 0; i < m_tiles.size(); i++)
+  {
+    const QByteArray &tile = m_tiles[i];
+    if (tile.isNull())
+      continue;
+    const QRect r = tile_rect(i % m_columns, i / m_columns);
+    const uchar *src = reinterpret_cast<const uchar *>(tile.constData());
+    for (int y = r.top(); y <= r.bottom(); y++)
+    {
+      unpack_row(src + (y - r.top()) * m_channels * r.width(), r.width(), m_channels,
+                 bits + y * stride + 4 * r.left());
+    }
+  }
+  return image;
+}
+
+void TiledOverlay::paint(QPainter *painter) const
+{
+  for (int i = 0; i < m_tiles.size(); i++)
+  {
+    if (m_tiles[i].isNull())
+      continue;
+    const QRect r = tile_rect(i % m_columns, i / m_columns);
+    QImage tile(r.size(), QImage::Format_RGBA8888_Premultiplied);
+    const uchar *src = reinterpret_cast<const uchar *>(m_tiles[i].constData());
+    for (int y = 0; y < r.height(); y++)
+    {
+      unpack_row(src + y * m_channels * r.width(), r.width(), m_channels, tile.scanLine(y));
+    }
+    painter->drawImage(r.topLeft(), tile);
+  }
+}
+
+QSize TiledOverlay::size() const { return m_size; }
+
+int TiledOverlay::channels() const { return m_channels; }
+
+bool TiledOverlay::is_empty() const { return m_painted == 0; }
+
+qint64 TiledOverlay::bytes() const
+{
+  qint64 total = 0;
+  for (const QByteArray &tile : m_tiles)
+  {
+    total += tile.size();
+  }
+  return total;
+}
+
+const uchar *TiledOverlay::span(int x, int y, int count, uchar *buffer) const
+{
+  if (m_painted == 0 || y < 0 || y >= m_size.height() || count <= 0)
+    return nullptr;
+
+  const int row = y / tile_side;
+  const int first = x / tile_side;
+  const int last = (x + count - 1) / tile_side;
+  bool any = false;
+  for (int c = first; c <= last && !any; c++)
+  {
+    any = !m_tiles[index(c, row)].isNull();
+  }
+  if (!any)
+    return nullptr;
+
+  for (int c = first; c <= last; c++)
+  {
+    const QRect r = tile_rect(c, row);
+    const int x0 = std::max(x, r.left());
+    const int x1 = std::min(x + count - 1, r.right());
+    uchar *dst = buffer + m_channels * (x0 - x);
+    const QByteArray &tile = m_tiles[index(c, row)];
+    if (tile.isNull())
+      memset(dst, 0, m_channels * (x1 - x0 + 1));
+    else
+      memcpy(dst,
+             tile.constData() + m_channels * ((y - r.top()) * r.width() + x0 - r.left()),
+             m_channels * (x1 - x0 + 1));
+  }
+  return buffer;
+}
+
+bool TiledOverlay::painted(const QRect &r) const
+{
+  const QRect a = r.intersected(QRect(QPoint(0, 0), m_size));
+  if (m_painted == 0 || a.isEmpty())
+    return false;
+
+  for (int row = a.top() / tile_side; row <= a.bottom() / tile_side; row++)
+  {
+    for (int c = a.left() / tile_side; c <= a.right() / tile_side; c++)
+    {
+      if (!m_tiles[index(c, row)].isNull())
+        return true;
+    }
+  }
+  return false;
+}
+
+/* Whole tiles are hashed, so a change next to r may change the hash of r
+ * too; that only costs a recompute. */
+quint64 TiledOverlay::hash(const QRect &r) const
+{
+  const QRect a = r.intersected(QRect(QPoint(0, 0), m_size));
+  quint64 h = static_cast<quint64>(a.width()) << 32 | static_cast<quint32>(a.height());
+  if (a.isEmpty())
+    return h;
+
+  for (int row = a.top() / tile_side; row <= a.bottom() / tile_side; row++)
+  {
+    for (int c = a.left() / tile_side; c <= a.right() / tile_side; c++)
+    {
+      h = hash_bytes(reinterpret_cast<const uchar *>(&m_hashes[index(c, row)]), sizeof(quint64), h);
+    }
+  }
+  return h;
+}
+
+/* Layout of the .overlay entries: magic, version, width, height, channels,
+ * tile side and painted tile count, then index and bytes of each painted
+ * tile, as a QDataStream */
+static const quint32 overlay_magic = 0x4c544f56;
+static const quint32 overlay_version = 1;
+
+TiledOverlay TiledOverlay::load(const QByteArray &data)
+{
+  QDataStream in(data);
+  quint32 magic = 0, version = 0;
+  qint32 width = 0, height = 0, channels = 0, side = 0, painted = 0;
+  in >> magic >> version >> width >> height >> channels >> side >> painted;
+  if (in.status() != QDataStream::Ok || magic != overlay_magic || version != overlay_version ||
+      side != tile_side || (channels != 2 && channels != 4) || width < 0 || height < 0)
+    return TiledOverlay();
+
+  TiledOverlay ov(QSize(width, height), channels);
+  for (int k = 0; k < painted; k++)
+  {
+    qint32 i = -1;
+    QByteArray tile;
+    in >> i >> tile;
+    if (in.status() != QDataStream::Ok || i < 0 || i >= ov.m_tiles.size())
+      return TiledOverlay();
+    const QRect r = ov.tile_rect(i % ov.m_columns, i / ov.m_columns);
+    if (tile.size() != channels * r.width() * r.height())
+      return TiledOverlay();
+
+    quint64 h = static_cast<quint64>(r.width()) << 32 | static_cast<quint32>(r.height());
+    for (int y = 0; y < r.height(); y++)
+    {
+      h = hash_bytes(reinterpret_cast<const uchar *>(tile.constData()) + y * channels * r.width(),
+                     channels * r.width(), h);
+    }
+    ov.m_painted += ov.m_tiles[i].isNull();
+    ov.m_tiles[i] = tile;
+    ov.m_hashes[i] = h | 1;
+  }
+  return ov;
+}
+
+int TiledOverlay::index(int column, int row) const { return row * m_columns + column; }
+
+QRect TiledOverlay::tile_rect(int column, int row) const
+{
+  return QRect(column * tile_side, row * tile_side, tile_side, tile_side)
+      .intersected(QRect(QPoint(0, 0), m_size));
+}
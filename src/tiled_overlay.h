@@ -0,0 +1,86 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef TILEDOVERLAY_H
+#define TILEDOVERLAY_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QPoint>
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+class QPainter;
+
+/* Brush overlay stored as square tiles that are only allocated once
+ * something is painted on them. Most of an overlay is never painted, so it
+ * costs no memory, and the blend steps skip the unpainted tiles. Tiles are
+ * packed premultiplied pixels of 4 channels (RGBA), or of 2 (value, alpha)
+ * for the overlays of gray maps. They are implicitly shared: copies are
+ * cheap, and an overlay is never modified once it is built. */
+class TiledOverlay
+{
+public:
+  static const int tile_side = 64;
+
+  TiledOverlay();
+  /* Unpainted overlay of size, nothing is allocated */
+  explicit TiledOverlay(QSize size, int channels = 4);
+  /* The painted tiles of image, keeping red and alpha only with 2
+   * channels. Tiles equal to those of previous are shared with it instead
+   * of being copied. */
+  static TiledOverlay from_image(const QImage &image, const TiledOverlay &previous = TiledOverlay(),
+                                 int channels = 4);
+  /* RGBA8888_Premultiplied, 2 channel overlays come out gray */
+  QImage to_image() const;
+  /* Overlay of an .overlay project entry, which projects stored gray
+   * overlays as for a while; they are PNG again. Null for other data. */
+  static TiledOverlay load(const QByteArray &data);
+  /* Draws the painted tiles at their place */
+  void paint(QPainter *painter) const;
+
+  QSize size() const;
+  int channels() const;
+  bool is_empty() const;
+  qint64 bytes() const;
+
+  /* count pixels of row y starting at x, copied into buffer (channels *
+   * count bytes, unpainted pixels are 0), or nullptr when no painted tile
+   * touches the span */
+  const uchar *span(int x, int y, int count, uchar *buffer) const;
+  /* Whether any painted tile touches r */
+  bool painted(const QRect &r) const;
+  /* Content hash of r: equal hashes, equal pixels in r */
+  quint64 hash(const QRect &r) const;
+
+private:
+  int index(int column, int row) const;
+  QRect tile_rect(int column, int row) const;
+
+  QSize m_size;
+  int m_channels = 4;
+  int m_columns = 0, m_rows = 0;
+  /* Rows of channels * width bytes, null for unpainted tiles */
+  QVector<QByteArray> m_tiles;
+  QVector<quint64> m_hashes;
+  int m_painted = 0;
+};
+
+#endif // TILEDOVERLAY_H
@@ -0,0 +1,73 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef TILING_H
+#define TILING_H
+
+#include "src/cancellation.h"
+#include "src/worker_pool.h"
+
+/* Tiling policy of the per pixel loops.
+ *
+ * Neighbourhood kernels (gradients, normal composition, overlay blends)
+ * cut their area in tiles of tile_width x tile_height pixels, clipped to
+ * the area. Inside a tile pixels are visited row by row with x innermost,
+ * which is the memory order of QImage scanlines and CImg planes alike. A
+ * 256 x 64 tile of floats is 64 KiB per plane, so the few planes a kernel
+ * reads and writes stay in L2 while it runs, and the rows above and below
+ * a tile row are still in L1. Tiles are handed to the pool dynamically,
+ * so transparent areas and short border tiles balance out. Once the running
+ * job is cancelled the remaining tiles are skipped.
+ *
+ * Pure streaming passes (format transposes, pointwise CImg arithmetic)
+ * touch every byte once and just walk whole rows. */
+
+const int tile_width = 256;
+const int tile_height = 64;
+
+struct Tile
+{
+  /* Inclusive bounds */
+  int x0, y0, x1, y1;
+};
+
+template <typename Function>
+void for_each_tile(int xmin, int ymin, int xmax, int ymax, Function fn)
+{
+  if (xmax < xmin || ymax < ymin)
+    return;
+
+  const int columns = (xmax - xmin) / tile_width + 1;
+  const int rows = (ymax - ymin) / tile_height + 1;
+  const int count = columns * rows;
+
+  parallel_for(count, count > 1, [&](int i) {
+    if (cancelled())
+      return;
+
+    Tile t;
+    t.x0 = xmin + (i % columns) * tile_width;
+    t.y0 = ymin + (i / columns) * tile_height;
+    t.x1 = t.x0 + tile_width - 1 < xmax ? t.x0 + tile_width - 1 : xmax;
+    t.y1 = t.y0 + tile_height - 1 < ymax ? t.y0 + tile_height - 1 : ymax;
+    fn(t);
+  });
+}
+
+#endif // TILING_H
@@ -0,0 +1,186 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "worker_pool.h"
+#include "cancellation.h"
+
+#include <algorithm>
+
+/* Index of the worker running on this thread, -1 elsewhere */
+static thread_local int worker_index = -1;
+static thread_local Priority thread_priority = Priority::Interactive;
+
+WorkerPool &WorkerPool::instance()
+{
+  static WorkerPool pool;
+  return pool;
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &t : threads)
+    t.join();
+}
+
+void WorkerPool::set_thread_count(int count) { requested = count; }
+
+int WorkerPool::thread_count()
+{
+  std::call_once(started, [this]() { start(); });
+  return count;
+}
+
+void WorkerPool::start()
+{
+  count = requested > 0 ? requested : std::max<int>(std::thread::hardware_concurrency(), 1);
+  local.reset(new Queue[count]);
+  for (int i = 0; i < count; i++)
+    threads.emplace_back(&WorkerPool::work, this, i);
+}
+
+void WorkerPool::submit(Priority priority, std::function<void()> task)
+{
+  std::call_once(started, [this]() { start(); });
+  Queue &queue = worker_index >= 0 ? local[worker_index] : shared;
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks[static_cast<int>(priority)].push_back({std::move(task), priority});
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    queued++;
+  }
+  wake.notify_one();
+}
+
+void WorkerPool::submit(std::function<void()> task) { submit(thread_priority, std::move(task)); }
+
+/* The most urgent task: own newest, then shared, then stolen oldest */
+bool WorkerPool::take(int index, std::function<void()> &task, Priority &priority)
+{
+  for (int p = 0; p < 3; p++)
+  {
+    for (int k = 0; k <= count; k++)
+    {
+      Queue &queue = k == 0 ? local[index] : k == 1 ? shared : local[(index + k - 1) % count];
+
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      std::deque<Task> &tasks = queue.tasks[p];
+      if (tasks.empty())
+        continue;
+
+      Task &t = k == 0 ? tasks.back() : tasks.front();
+      task = std::move(t.run);
+      priority = t.priority;
+      if (k == 0)
+        tasks.pop_back();
+      else
+        tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkerPool::work(int index)
+{
+  worker_index = index;
+  for (;;)
+  {
+    std::function<void()> task;
+    Priority priority;
+    if (take(index, task, priority))
+    {
+      thread_priority = priority;
+      task();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    wake.wait(lock, [this]() { return stopping || queued > 0; });
+    if (stopping)
+      return;
+  }
+}
+
+Priority current_priority() { return thread_priority; }
+
+PriorityScope::PriorityScope(Priority priority) : previous(thread_priority)
+{
+  thread_priority = priority;
+}
+
+PriorityScope::~PriorityScope() { thread_priority = previous; }
+
+namespace
+{
+/* Copies of a team running on helpers */
+struct Team
+{
+  std::mutex mutex;
+  std::condition_variable done;
+  bool open = true;
+  int active = 0;
+};
+}
+
+void parallel_team(int count, bool parallel, const std::function<void()> &team)
+{
+  WorkerPool &pool = WorkerPool::instance();
+  const int helpers = parallel ? std::min(count, pool.thread_count()) - 1 : 0;
+  if (helpers <= 0)
+  {
+    team();
+    return;
+  }
+
+  auto state = std::make_shared<Team>();
+  const std::function<void()> *body = &team;
+  const std::atomic<bool> *flag = cancel_flag();
+  for (int i = 0; i < helpers; i++)
+  {
+    pool.submit([state, body, flag]() {
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->open)
+          return;
+        state->active++;
+      }
+      {
+        CancelScope scope(flag);
+        (*body)();
+      }
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (--state->active == 0)
+        state->done.notify_all();
+    });
+  }
+
+  team();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->open = false;
+  state->done.wait(lock, [&]() { return state->active == 0; });
+}
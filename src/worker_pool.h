@@ -0,0 +1,133 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Priority classes of the pool. Workers always take the most urgent task
+ * available; running tasks are never preempted. */
+enum class Priority
+{
+  /* Previews and brush strokes, the user is waiting for them */
+  Interactive,
+  /* Full resolution maps that follow a preview */
+  Background,
+  /* CLI exports */
+  Batch
+};
+
+/* The one thread pool of the engine. Every map computation and every
+ * parallel loop inside it runs here, so the machine never sees more
+ * threads than thread_count(), however many processors are busy.
+ *
+ * Each worker has a deque per priority. Tasks queued by a worker go to its
+ * own deques, where it takes them newest first, and idle workers steal
+ * them oldest first; tasks from other threads go to a shared queue. Tasks
+ * run with the priority they were queued with, and queue their own tasks
+ * with it too. */
+class WorkerPool
+{
+public:
+  static WorkerPool &instance();
+
+  /* Worker count, 0 for one per core. Takes effect when the pool starts,
+   * so set it before any work is queued. */
+  void set_thread_count(int count);
+  int thread_count();
+
+  void submit(Priority priority, std::function<void()> task);
+  /* Queues task with the priority of the calling thread */
+  void submit(std::function<void()> task);
+
+private:
+  WorkerPool() {}
+  ~WorkerPool();
+  void start();
+  void work(int index);
+  bool take(int index, std::function<void()> &task, Priority &priority);
+
+  struct Task
+  {
+    std::function<void()> run;
+    Priority priority;
+  };
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks[3];
+  };
+
+  std::once_flag started;
+  int requested = 0;
+  int count = 0;
+  std::vector<std::thread> threads;
+  std::unique_ptr<Queue[]> local;
+  Queue shared;
+
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  std::atomic<int> queued{0};
+  bool stopping = false;
+};
+
+/* Priority the calling thread queues its tasks with, Interactive unless
+ * changed. Inside pool tasks it is the priority of the task. */
+Priority current_priority();
+
+class PriorityScope
+{
+public:
+  explicit PriorityScope(Priority priority);
+  ~PriorityScope();
+
+private:
+  Priority previous;
+};
+
+/* Runs team() on the calling thread and on pool helpers at the same time,
+ * at most count copies in all, like an OpenMP parallel region: the copies
+ * share the work through counters of their own. Helpers that haven't
+ * started when the calling thread's copy returns are dropped, so calls
+ * nest freely inside pool tasks without new threads or deadlocks. Helpers
+ * run with the priority and the cancellation scope of the calling thread.
+ * Runs only the calling thread's copy when !parallel. */
+void parallel_team(int count, bool parallel, const std::function<void()> &team);
+
+/* fn(i) for every i in [0, count), handed out one at a time to the team,
+ * like schedule(dynamic) */
+template <typename Function>
+void parallel_for(int count, bool parallel, Function fn)
+{
+  std::atomic<int> next(0);
+  parallel_team(count, parallel, [&]() {
+    for (int i = next++; i < count; i = next++)
+      fn(i);
+  });
+}
+
+#endif // WORKERPOOL_H